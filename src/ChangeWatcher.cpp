@@ -0,0 +1,134 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#include "pch.h"
+#include "ChangeWatcher.h"
+#include "cryptar.h"
+
+#include <chrono>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	const DWORD NotifyFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+		FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+	const DWORD BufferSize = 64 * 1024; // bigger buffers fail on network drives
+}
+
+struct ChangeWatcher::Root
+{
+	HANDLE dir = INVALID_HANDLE_VALUE;
+	HANDLE event = nullptr;
+	OVERLAPPED ov = {};
+	vector<DWORD> buf = vector<DWORD>(BufferSize / sizeof(DWORD)); // FILE_NOTIFY_INFORMATION is DWORD-aligned
+
+	bool Start()
+	{
+		ResetEvent(event);
+		ov = {};
+		ov.hEvent = event;
+		return !!ReadDirectoryChangesW(dir, buf.data(), BufferSize, TRUE, NotifyFilter, nullptr, &ov, nullptr);
+	}
+};
+
+ChangeWatcher::ChangeWatcher(const vector<filesystem::path>& roots)
+	: roots(roots), dirs(roots.size()) // not resized later: reading is pending into them
+{
+	for (size_t i = 0; i < roots.size(); ++i) {
+		Root& r = dirs[i];
+		r.dir = CreateFile(roots[i].c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0);
+		r.event = CreateEvent(0, TRUE, FALSE, 0);
+		if (r.dir == INVALID_HANDLE_VALUE || !r.event || !r.Start()) {
+			DWORD err = GetLastError();
+			Close();
+			throw MyException{ L"Failed to watch '<path>': <err>", roots[i].c_str(), err };
+		}
+	}
+}
+
+void ChangeWatcher::Close()
+{
+	for (auto& r : dirs) {
+		if (r.dir != INVALID_HANDLE_VALUE) {
+			DWORD bytes;
+			if (CancelIo(r.dir))
+				GetOverlappedResult(r.dir, &r.ov, &bytes, TRUE); // the buffer is not used after it
+			CloseHandle(r.dir);
+		}
+		if (r.event)
+			CloseHandle(r.event);
+		r.dir = INVALID_HANDLE_VALUE;
+		r.event = nullptr;
+	}
+}
+
+bool ChangeWatcher::Wait(unsigned window_ms, vector<map<PathString, bool>>& changes)
+{
+	changes.assign(roots.size(), {});
+	vector<HANDLE> events;
+	for (auto& r : dirs)
+		events.push_back(r.event);
+	bool complete = true;
+	bool any = false;
+	steady_clock::time_point end;
+	for (;;) {
+		DWORD timeout = INFINITE;
+		if (any) {
+			auto left = duration_cast<milliseconds>(end - steady_clock::now()).count();
+			if (left <= 0)
+				break;
+			timeout = (DWORD)left;
+		}
+		DWORD res = WaitForMultipleObjects((DWORD)events.size(), events.data(), FALSE, timeout);
+		if (res == WAIT_TIMEOUT)
+			break;
+		if (res >= WAIT_OBJECT_0 + events.size())
+			throw MyException{ L"Failed to watch '<path>': <err>", roots[0].c_str(), GetLastError() };
+		size_t i = res - WAIT_OBJECT_0;
+		Root& r = dirs[i];
+		DWORD bytes = 0;
+		if (!GetOverlappedResult(r.dir, &r.ov, &bytes, FALSE) || bytes == 0)
+			complete = false; // the buffer overflowed (ERROR_NOTIFY_ENUM_DIR), events are lost
+		else {
+			const BYTE* ptr = (const BYTE*)r.buf.data();
+			for (;;) {
+				auto fni = (const FILE_NOTIFY_INFORMATION*)ptr;
+				PathString name(fni->FileName, fni->FileNameLength / sizeof(WCHAR));
+				changes[i][name] |= fni->Action == FILE_ACTION_ADDED || fni->Action == FILE_ACTION_RENAMED_NEW_NAME;
+				if (!fni->NextEntryOffset)
+					break;
+				ptr += fni->NextEntryOffset;
+			}
+		}
+		if (!r.Start())
+			throw MyException{ L"Failed to watch '<path>': <err>", roots[i].c_str(), GetLastError() };
+		if (!any) {
+			any = true;
+			end = steady_clock::now() + milliseconds(window_ms);
+		}
+	}
+	return complete;
+}
+
+
+ChangeWatcher::~ChangeWatcher()
+{
+	Close();
+}
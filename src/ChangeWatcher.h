@@ -0,0 +1,48 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <filesystem>
+
+#include "CommonFunc.h"
+
+// Watches trees of directories for changes of their items with ReadDirectoryChangesW.
+// Events of one item are coalesced: it is reported once however many times it was changed.
+class ChangeWatcher
+{
+public:
+	// throws MyException if a directory can not be watched
+	explicit ChangeWatcher(const std::vector<std::filesystem::path>& roots);
+	~ChangeWatcher();
+	ChangeWatcher(const ChangeWatcher&) = delete;
+	ChangeWatcher& operator=(const ChangeWatcher&) = delete;
+
+	// Waits for the first change, then collects changes for window_ms more milliseconds.
+	// changes[i] - items of roots[i]: path relative to the root -> the item appeared (created or moved in).
+	// Returns false if events are lost (the queue of the system overflowed), the trees must be rescanned.
+	bool Wait(unsigned window_ms, std::vector<std::map<PathString, bool>>& changes);
+
+protected:
+	void Close();
+
+	std::vector<std::filesystem::path> roots;
+	struct Root;
+	std::vector<Root> dirs;
+};
@@ -16,6 +16,7 @@
 
 #include "pch.h"
 #include "CommonFunc.h"
+#include "PathTable.h"
 
 
 using namespace std;
@@ -117,71 +118,116 @@ bool is_stream_name(const wchar_t* entry)
 }
 
 
-Coro::generator<DirItem> get_streams(filesystem::path entry, const wchar_t* sep)
+Coro::generator<DirItem> get_streams(const PathTable& paths, DirItem entry)
 {
 	// Enumerate file's streams and print their sizes and names
+	wstring path;
+	if (entry.name.empty()) // directory itself
+		paths.FullPath(entry.parent, path);
+	else
+		paths.FullPath(entry, path);
+	wstring name;
 	WIN32_FIND_STREAM_DATA fsd;
-	HANDLE hFind = ::FindFirstStreamW(entry.c_str(), FindStreamInfoStandard, &fsd, 0);
+	HANDLE hFind = ::FindFirstStreamW(path.c_str(), FindStreamInfoStandard, &fsd, 0);
 	for (bool ok = hFind != INVALID_HANDLE_VALUE; ok; ok = !!::FindNextStreamW(hFind, &fsd))
 	{
 		if (wcscmp(fsd.cStreamName, L"::$DATA") == 0) // this is the main stream
 			continue;
 		wstring_view stream_name = RemoveAtEnd(fsd.cStreamName, L":$DATA"); // name without ":$DATA" in the end
-		filesystem::path full = wstring(entry) + sep + wstring(stream_name);
-		DirItem it = { DirItem::Stream, full,  (ULONGLONG)fsd.StreamSize.QuadPart };
-		co_yield it;
+		name.assign(entry.name);
+		name += stream_name; // "file:stream" or ":stream" for directory
+		co_yield DirItem{ DirItem::Stream, entry.parent, name, (ULONGLONG)fsd.StreamSize.QuadPart };
 	}
 	if (hFind != INVALID_HANDLE_VALUE)
 		::FindClose(hFind);
 }
 
-Coro::generator<DirItem> get_files(std::filesystem::path path)
+Coro::generator<DirItem> get_files(const PathTable& paths, uint32_t ix)
 {
-	for (auto& dir_stream : get_streams(path, L"\\")) // stream for directory itself
-		co_yield dir_stream;
-
-	WIN32_FIND_DATA ffd;
-	HANDLE hFind = FindFirstFile((path / L"*").c_str(), &ffd);
-	if (hFind != INVALID_HANDLE_VALUE) {
+	co_yield Coro::elements_of(get_streams(paths, DirItem{ DirItem::Dir, ix })); // stream for directory itself
+
+	// the open directory is read in batches of entries with their types, sizes and times
+	wstring path;
+	paths.FullPath(ix, path);
+	HANDLE hDir = CreateFile(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+	if (hDir == INVALID_HANDLE_VALUE)
+		co_return;
+	vector<ULONGLONG> batch(64 * 1024 / sizeof(ULONGLONG)); // entries are aligned to 8 bytes
+	wstring name; // zero-terminated copy of the entry name
+	for (auto info_class = FileIdBothDirectoryRestartInfo;
+		GetFileInformationByHandleEx(hDir, info_class, batch.data(), DWORD(batch.size() * sizeof(ULONGLONG)));
+		info_class = FileIdBothDirectoryInfo)
+	{
+		for (auto entry = (const BYTE*)batch.data();;) {
+			auto& fi = *(const FILE_ID_BOTH_DIR_INFO*)entry;
+			name.assign(fi.FileName, fi.FileNameLength / sizeof(WCHAR));
+			if (name != L"." && name != L"..") {
+				DirItem::Type type = fi.FileAttributes & FILE_ATTRIBUTE_DIRECTORY ? DirItem::Dir : DirItem::File;
+				co_yield DirItem{ type, ix, name, (ULONGLONG)fi.EndOfFile.QuadPart,
+					fi.FileAttributes, (const FILETIME&)fi.LastWriteTime };
+			}
+			if (!fi.NextEntryOffset)
+				break;
+			entry += fi.NextEntryOffset;
+		}
+	}
+	CloseHandle(hDir);
+}
 
-		do
-		{
-			if (wcscmp(ffd.cFileName, L".") == 0 || wcscmp(ffd.cFileName, L"..") == 0)
-				continue;
-			DirItem::Type type = ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? DirItem::Dir : DirItem::File;
-			co_yield DirItem{ type, path / ffd.cFileName, FileSizeFrom(ffd),
-				ffd.dwFileAttributes, ffd.ftLastWriteTime };
-		} while (FindNextFile(hFind, &ffd) != 0);
-		FindClose(hFind);
+bool physical_offset(HANDLE file, ULONGLONG& offset)
+{
+	STARTING_VCN_INPUT_BUFFER vcn = {};
+	RETRIEVAL_POINTERS_BUFFER rp = {}; // room for the first extent only, ERROR_MORE_DATA is ok
+	DWORD bytes;
+	if ((::DeviceIoControl(file, FSCTL_GET_RETRIEVAL_POINTERS, &vcn, sizeof(vcn), &rp, sizeof(rp), &bytes, 0)
+		|| GetLastError() == ERROR_MORE_DATA) && rp.ExtentCount > 0 && rp.Extents[0].Lcn.QuadPart != -1)
+	{
+		offset = (ULONGLONG)rp.Extents[0].Lcn.QuadPart;
+		return true;
 	}
+	// small files are resident in MFT, their records go in the order of file index
+	BY_HANDLE_FILE_INFORMATION fi;
+	offset = ::GetFileInformationByHandle(file, &fi) ? ((ULONGLONG)fi.nFileIndexHigh << 32) | fi.nFileIndexLow : 0;
+	return false;
+}
+
+bool hard_link_id(HANDLE file, FileId& id)
+{
+	BY_HANDLE_FILE_INFORMATION fi;
+	if (!::GetFileInformationByHandle(file, &fi) || fi.nNumberOfLinks <= 1)
+		return false;
+	id = { fi.dwVolumeSerialNumber, ((ULONGLONG)fi.nFileIndexHigh << 32) | fi.nFileIndexLow };
+	return true;
 }
 
-Coro::generator<DirItem> directory_items(filesystem::path path)
+Coro::generator<DirItem> directory_items(const PathTable& paths, uint32_t ix)
 {
-	for (auto& dir_stream : get_streams(path, L"\\")) // stream for directory itself
-		co_yield dir_stream;
+	co_yield Coro::elements_of(get_streams(paths, DirItem{ DirItem::Dir, ix })); // stream for directory itself
 
-	for (auto& entry : filesystem::directory_iterator(path))
+	PathString path;
+	for (auto& entry : filesystem::directory_iterator(paths.FullPath(ix, path)))
 	{
+		PathString name = entry.path().filename().native();
 		if (entry.is_directory())
-			co_yield DirItem{ DirItem::Dir, entry.path(),  0 };
+			co_yield DirItem{ DirItem::Dir, ix, name, 0 };
 		else if (entry.is_regular_file())
 		{
-			co_yield DirItem{ DirItem::File, entry.path(),  entry.file_size() };
+			DirItem file = { DirItem::File, ix, name, entry.file_size() };
+			co_yield file;
 
-			for (auto& file_stream : get_streams(entry.path(), L""))
-				co_yield file_stream;
+			co_yield Coro::elements_of(get_streams(paths, file));
 		}
 	}
 }
 
-Coro::generator<DirItem> get_files_multi(const std::vector<filesystem::path>& items)
+Coro::generator<DirItem> get_files_multi(PathTable& paths, const std::vector<filesystem::path>& items)
 {
 	for (auto& p : items)
 	{
 		if (p == L".") {
-			for (auto& it : get_files(filesystem::current_path()))
-				co_yield it;
+			filesystem::path cwd = filesystem::current_path();
+			co_yield Coro::elements_of(get_files(paths, paths.Add(DirItem::NoParent, cwd.native())));
 			continue;
 		}
 		WIN32_FILE_ATTRIBUTE_DATA adata = {};
@@ -189,6 +235,6 @@ Coro::generator<DirItem> get_files_multi(const std::vector<filesystem::path>& it
 			!GetFileAttributesEx(p.c_str(), GetFileExInfoStandard, &adata) ? DirItem::Invalid :
 			adata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? DirItem::Dir :
 			is_stream_name(p.c_str()) ? DirItem::Stream : DirItem::File;
-		co_yield DirItem{ type, p, FileSizeFrom(adata), adata.dwFileAttributes, adata.ftLastWriteTime };
+		co_yield DirItem{ type, DirItem::NoParent, p.native(), FileSizeFrom(adata), adata.dwFileAttributes, adata.ftLastWriteTime };
 	}
 }
@@ -20,6 +20,7 @@
 #include <string>
 #include <string_view>
 #include <filesystem>
+#include <compare>
 
 #include "CoroGenerator.h"
 
@@ -30,18 +31,44 @@ std::vector<std::wstring> split(std::wstring_view str, wchar_t delim);
 bool mask_match(const wchar_t* str, const wchar_t* mask);
 bool mask_match(const wchar_t* str, const std::vector<std::wstring> &masks);
 
+using PathChar = std::filesystem::path::value_type;
+using PathString = std::basic_string<PathChar>;
+using PathView = std::basic_string_view<PathChar>;
+
 struct DirItem
 {
+	static constexpr uint32_t NoParent = 0xFFFFFFFF;
 	enum Type { Dir, File, Stream, Invalid };
 	Type type;
-	std::filesystem::path name;
+	uint32_t parent;  // index of the parent directory in PathTable, NoParent if name is the full path
+	PathView name;    // name in the parent directory, zero-terminated, points to the buffer of enumerator (valid until the next item)
 	ULONGLONG size;
 	DWORD    dwFileAttributes; // FILE_ATTRIBUTE_DIRECTORY FILE_ATTRIBUTE_ARCHIVE FILE_ATTRIBUTE_HIDDEN FILE_ATTRIBUTE_NORMAL FILE_ATTRIBUTE_READONLY FILE_ATTRIBUTE_SYSTEM
 	FILETIME ftLastWriteTime;
+
+	PathView filename() const; // last component of name
 };
 
+class PathTable;
+
 bool is_stream_name(const wchar_t* entry);
-Coro::generator<DirItem> get_streams(std::filesystem::path entry, const wchar_t* sep);
-Coro::generator<DirItem> get_files(std::filesystem::path path); // WinAPI
-Coro::generator<DirItem> directory_items(std::filesystem::path path); // std::filesystem
-Coro::generator<DirItem> get_files_multi(const std::vector<std::filesystem::path>& items);
+// streams of file or directory 'entry', for directory they are named ":stream" and are in it, for file "file:stream"
+Coro::generator<DirItem> get_streams(const PathTable& paths, DirItem entry);
+// items of directory 'dir' registered in paths
+Coro::generator<DirItem> get_files(const PathTable& paths, uint32_t dir); // WinAPI
+Coro::generator<DirItem> directory_items(const PathTable& paths, uint32_t dir); // std::filesystem
+Coro::generator<DirItem> get_files_multi(PathTable& paths, const std::vector<std::filesystem::path>& items);
+
+// place of file data on the disk (first extent) to read files in the order of their placement;
+// returns false if it is unknown (resident or empty file), 'offset' is file id/inode then
+bool physical_offset(HANDLE file, ULONGLONG& offset);
+
+// identity of a file on its volume
+struct FileId
+{
+	ULONGLONG device;
+	ULONGLONG inode;
+	auto operator<=>(const FileId&) const = default;
+};
+// returns false if the file has only one name (hard link)
+bool hard_link_id(HANDLE file, FileId& id);
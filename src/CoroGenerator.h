@@ -1,29 +1,163 @@
 #pragma once
 
 #include <coroutine>
+#include <cstddef>
+#include <exception>
 #include <memory>
+#include <type_traits>
+#include <utility>
 
 namespace Coro {
+	// Coroutine frames are kept in a thread-local pool by power-of-two size classes,
+	// so generators created for every directory and file reuse memory instead of malloc/free.
+	class FramePool
+	{
+	public:
+		static void* allocate(std::size_t size)
+		{
+			std::size_t cls = size_class(size);
+			if (cls >= ClassCount)
+				return ::operator new(size);
+			Lists& l = lists();
+			if (l.count[cls])
+				return l.blocks[cls][--l.count[cls]];
+			return ::operator new(MinSize << cls);
+		}
+		static void deallocate(void* ptr, std::size_t size) noexcept
+		{
+			std::size_t cls = size_class(size);
+			if (cls < ClassCount) {
+				Lists& l = lists();
+				if (l.count[cls] < MaxFree) {
+					l.blocks[cls][l.count[cls]++] = ptr;
+					return;
+				}
+			}
+			::operator delete(ptr);
+		}
+	private:
+		static constexpr std::size_t MinSize = 64;    // smallest class
+		static constexpr std::size_t ClassCount = 12; // up to 128K
+		static constexpr std::size_t MaxFree = 16;    // kept blocks per class
+		struct Lists {
+			void* blocks[ClassCount][MaxFree];
+			std::size_t count[ClassCount] = {};
+			~Lists()
+			{
+				for (std::size_t cls = 0; cls < ClassCount; ++cls)
+					while (count[cls])
+						::operator delete(blocks[cls][--count[cls]]);
+			}
+		};
+		static std::size_t size_class(std::size_t size) noexcept
+		{
+			std::size_t cls = 0;
+			while (cls < ClassCount && (MinSize << cls) < size)
+				++cls;
+			return cls;
+		}
+		static Lists& lists()
+		{
+			static thread_local Lists l;
+			return l;
+		}
+	};
+
+	// co_yield elements_of(gen) yields all elements of nested generator:
+	// the consumer resumes the innermost generator directly, not through every level
+	// (only reference is kept: some compilers copy temporaries of co_yield operand bitwise)
+	template<typename G>
+	struct elements_of {
+		G& gen;
+		elements_of(G& gen) noexcept : gen(gen) {}
+		elements_of(G&& gen) noexcept : gen(gen) {}
+	};
+	template<typename G>
+	elements_of(G&&) -> elements_of<std::remove_reference_t<G>>;
+
 	// TODO C++23 replace with std::generator
 	template<typename T>
 	struct [[nodiscard]] generator {
+		struct promise_type;
+		using Handle = std::coroutine_handle<promise_type>;
+
 		struct promise_type {
-			const T* value;
+			const T* value;                 // used in the root (outermost) generator
 			std::exception_ptr exception;
+			promise_type* root = this;      // outermost generator
+			Handle parent = nullptr;        // generator which yields elements of this one
+			Handle nested = nullptr;        // owned generator whose elements are yielded now
+			Handle leaf = nullptr;          // root: innermost generator to be resumed
+
+			promise_type() = default;
+			promise_type(const promise_type&) = delete;
+			~promise_type()
+			{
+				if (nested)
+					nested.destroy();
+			}
 
-			generator get_return_object() noexcept { return generator{ *this }; }
+			static void* operator new(std::size_t size) { return FramePool::allocate(size); }
+			static void operator delete(void* ptr, std::size_t size) noexcept { FramePool::deallocate(ptr, size); }
+
+			generator get_return_object() noexcept
+			{
+				leaf = Handle::from_promise(*this);
+				return generator{ *this };
+			}
 			std::suspend_always initial_suspend() const noexcept { return {}; }
-			std::suspend_always final_suspend() const noexcept { return {}; }
 			void unhandled_exception() noexcept { exception = std::current_exception(); }
 			void return_void() const noexcept { }
 			std::suspend_always yield_value(const T& valRef) noexcept
 			{
-				value = std::addressof(valRef);
+				root->value = std::addressof(valRef);
 				return {};
 			}
-		};
 
-		using Handle = std::coroutine_handle<promise_type>;
+			struct final_awaiter {
+				bool await_ready() const noexcept { return false; }
+				std::coroutine_handle<> await_suspend(Handle h) noexcept
+				{
+					promise_type& p = h.promise();
+					if (!p.parent)
+						return std::noop_coroutine(); // back to consumer
+					p.root->leaf = p.parent;
+					return p.parent; // continue the generator which yields elements of this one
+				}
+				void await_resume() const noexcept {}
+			};
+			final_awaiter final_suspend() const noexcept { return {}; }
+
+			// awaiter keeps only handles, the nested generator is owned by the promise of the yielding one
+			struct nested_awaiter {
+				Handle nested;
+				bool await_ready() const noexcept { return !nested; }
+				std::coroutine_handle<> await_suspend(Handle h) noexcept
+				{
+					promise_type& p = nested.promise();
+					p.root = h.promise().root;
+					p.parent = h;
+					p.root->leaf = nested;
+					return nested;
+				}
+				void await_resume()
+				{
+					if (!nested)
+						return;
+					promise_type& p = nested.promise();
+					auto exception = std::exchange(p.exception, nullptr);
+					p.parent.promise().nested = nullptr;
+					nested.destroy();
+					if (exception)
+						std::rethrow_exception(exception);
+				}
+			};
+			nested_awaiter yield_value(elements_of<generator> elements) noexcept
+			{
+				nested = std::exchange(elements.gen.handle, nullptr);
+				return nested_awaiter{ nested };
+			}
+		};
 
 		struct iterator {
 			using iterator_category = std::input_iterator_tag;
@@ -36,7 +170,7 @@ namespace Coro {
 
 			iterator& operator++()
 			{
-				handle.resume();
+				handle.promise().leaf.resume();
 				if (handle.done()) {
 					auto exception = std::exchange(handle.promise().exception, nullptr);
 					handle = nullptr;
@@ -76,6 +210,8 @@ namespace Coro {
 
 		generator& operator=(generator&& that) noexcept
 		{
+			if (handle)
+				handle.destroy();
 			handle = std::exchange(that.handle, nullptr);
 			return *this;
 		}
@@ -15,6 +15,8 @@
 
 #pragma once
 
+#include "Throttle.h"
+
 class FileSimple
 {
 public:
@@ -27,6 +29,7 @@ public:
 	~FileSimple() { Close(); }
 	bool Open(LPCTSTR name, bool write, bool sequential)
 	{
+		Throttle::Take(Throttle::Open, 1);
 		m_hFile = CreateFile(name, write ? GENERIC_WRITE : GENERIC_READ,
 			write ? 0 : FILE_SHARE_READ, 0, write ? CREATE_ALWAYS : OPEN_EXISTING,
 			sequential ? FILE_FLAG_SEQUENTIAL_SCAN : 0, 0);
@@ -34,6 +37,7 @@ public:
 	}
 	bool OpenRW(LPCTSTR name) // opens for read-write
 	{
+		Throttle::Take(Throttle::Open, 1);
 		m_hFile = CreateFile(name, GENERIC_WRITE | GENERIC_READ, 0, 0, OPEN_ALWAYS, 0, 0);
 		return IsOpen();
 	}
@@ -72,6 +76,13 @@ public:
 		if (!IsOpen()) return 0;
 		return SetFilePointer(m_hFile, offset, 0, from);
 	}
+	bool Seek(LONGLONG offset, DWORD from = FILE_CURRENT) // 64-bit SetPosition
+	{
+		if (!IsOpen()) return false;
+		LARGE_INTEGER li;
+		li.QuadPart = offset;
+		return !!SetFilePointerEx(m_hFile, li, 0, from);
+	}
 	BOOL SetEOF()
 	{
 		if (!IsOpen()) return FALSE;
@@ -81,6 +92,7 @@ public:
 	{
 		if (!IsOpen()) return 0;
 		if (count == 0) return 0;
+		Throttle::Take(Throttle::Read, count);
 		if (!ReadFile(m_hFile, buffer, count, &count, 0)) return 0;
 		return count;
 	}
@@ -88,6 +100,7 @@ public:
 	{
 		if (!IsOpen()) return 0;
 		if (count == 0) return 0;
+		Throttle::Take(Throttle::Write, count);
 		if (!WriteFile(m_hFile, buffer, count, &count, 0)) return 0;
 		return count;
 	}
@@ -96,6 +109,12 @@ public:
 		if (!IsOpen()) return 0;
 		return GetFileSize(m_hFile, 0);
 	}
+	ULONGLONG GetLength64()
+	{
+		LARGE_INTEGER li;
+		if (!IsOpen() || !GetFileSizeEx(m_hFile, &li)) return 0;
+		return li.QuadPart;
+	}
 	HANDLE Handle() { return m_hFile; }
 protected:
 	HANDLE  m_hFile;
@@ -0,0 +1,85 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+#include "pch.h"
+#include "MemoryBudget.h"
+#include "cryptar.h"
+
+#include <algorithm>
+#include <psapi.h>
+
+using namespace std;
+
+namespace
+{
+	MemoryBudget* active = nullptr;
+}
+
+MemoryBudget::MemoryBudget(ULONGLONG limit)
+	: limit(limit)
+{
+	active = this;
+}
+
+MemoryBudget::~MemoryBudget()
+{
+	active = nullptr;
+}
+
+// Shares are taken when stages are created, on the thread of the archiver: nothing would return memory
+// while it waits, so a share which does not fit is an error.
+MemoryBudget::Share::Share(size_t least, size_t most)
+	: size(most), budget(active)
+{
+	if (!budget)
+		return;
+	lock_guard<mutex> lock(budget->mtx);
+	ULONGLONG free = budget->limit - budget->taken;
+	if (free < least)
+		throw MyException{ L"Memory budget is too small: <path> more bytes are needed for buffers", to_wstring(least - free), 0 };
+	size = (size_t)min<ULONGLONG>(most, max<ULONGLONG>(least, free / 2)); // the stages created later get their part
+	budget->taken += size;
+	budget->peak = max(budget->peak, budget->taken);
+}
+
+MemoryBudget::Share::~Share()
+{
+	if (!budget)
+		return;
+	lock_guard<mutex> lock(budget->mtx);
+	budget->taken -= size;
+}
+
+ULONGLONG MemoryBudget::Limit()
+{
+	return active ? active->limit : 0;
+}
+
+ULONGLONG MemoryBudget::Peak()
+{
+	if (!active)
+		return 0;
+	lock_guard<mutex> lock(active->mtx);
+	return active->peak;
+}
+
+ULONGLONG PeakProcessMemory()
+{
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return pmc.PeakWorkingSetSize;
+}
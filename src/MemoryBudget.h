@@ -0,0 +1,59 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+#pragma once
+
+#include <mutex>
+
+// Memory budget of buffering stages (tar /q:size, untar /q:size): frames and blocks in work, files read ahead
+// and the chunk index of deduplication are sized by the shares they get, queues of stages are limited by them,
+// so producers wait for workers instead of growing. Without a budget the stages take their usual sizes.
+class MemoryBudget
+{
+public:
+	explicit MemoryBudget(ULONGLONG limit);
+	~MemoryBudget();
+	MemoryBudget(const MemoryBudget&) = delete;
+	MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+	// a part of the budget held by a stage, returned when destroyed
+	class Share
+	{
+	public:
+		// takes from 'least' to 'most' bytes, up to a half of free ones (without budget - 'most');
+		// throws MyException if 'least' bytes are not free
+		Share(size_t least, size_t most);
+		~Share();
+		Share(const Share&) = delete;
+		Share& operator=(const Share&) = delete;
+		size_t Size() const { return size; }
+	protected:
+		size_t size;
+		MemoryBudget* budget;
+	};
+
+	static ULONGLONG Limit(); // 0 - no budget
+	static ULONGLONG Peak();  // the most bytes taken at once
+
+protected:
+	ULONGLONG limit;
+	std::mutex mtx; // protects all below
+	ULONGLONG taken = 0;
+	ULONGLONG peak = 0;
+};
+
+// the peak of physical memory used by the process (working set)
+ULONGLONG PeakProcessMemory();
@@ -0,0 +1,195 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+#include "pch.h"
+#include "ParallelLister.h"
+
+using namespace std;
+
+ParallelLister::ParallelLister(PathTable& paths, unsigned nthreads, const vector<wstring>& exclude, size_t max_ahead)
+	: paths(paths), exclude(exclude), share(0, max_ahead), max_ahead(share.Size())
+{
+	for (unsigned i = 0; i <= nthreads; ++i)
+		queues.push_back(make_unique<WorkQueue>());
+	for (unsigned i = 0; i < nthreads; ++i)
+		threads.emplace_back(&ParallelLister::WorkerThread, this, i);
+}
+
+ParallelLister::~ParallelLister()
+{
+	{
+		lock_guard lock(mtx);
+		stop = true;
+	}
+	cv_work.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+ParallelLister::ListingPtr ParallelLister::TakeTask(size_t ix)
+{
+	// own queue first (the most recently scheduled - depth first), then steal the oldest one from others
+	for (size_t n = 0; n < queues.size(); ++n) {
+		WorkQueue& q = *queues[(ix + n) % queues.size()];
+		lock_guard lock(q.mtx);
+		if (q.tasks.empty())
+			continue;
+		ListingPtr task;
+		if (n == 0) {
+			task = move(q.tasks.back());
+			q.tasks.pop_back();
+		}
+		else {
+			task = move(q.tasks.front());
+			q.tasks.pop_front();
+		}
+		return task;
+	}
+	return nullptr;
+}
+
+void ParallelLister::WorkerThread(size_t ix)
+{
+	for (;;) {
+		{
+			unique_lock lock(mtx);
+			cv_work.wait(lock, [this] { return stop || (queued > 0 && ahead < max_ahead); });
+			if (stop)
+				return;
+		}
+		ListingPtr task = TakeTask(ix);
+		if (!task)
+			continue;
+		{
+			lock_guard lock(mtx);
+			--queued;
+		}
+		int expected = Queued;
+		if (task->state.compare_exchange_strong(expected, Running)) // can be already taken by consumer
+			List(*task, ix);
+	}
+}
+
+void ParallelLister::List(Listing& listing, size_t ix)
+{
+	vector<ListingPtr> subdirs;
+	vector<size_t> offsets; // of names in listing.names
+	try {
+		for (auto& it : ::get_files(paths, listing.ix)) {
+			listing.items.push_back(it);
+			offsets.push_back(listing.names.size());
+			listing.names.append(it.name);
+			listing.names += PathChar(0);
+			if (it.type == DirItem::Dir && !mask_match(it.filename().data(), exclude)) {
+				auto sub = make_shared<Listing>();
+				sub->dir = Key{ it.parent, PathString(it.name) };
+				sub->ix = paths.Add(it); // keeps the parent until the subdirectory is released
+				subdirs.push_back(move(sub));
+			}
+		}
+	}
+	catch (...) {
+		listing.error = current_exception();
+	}
+	// names are stored now, the buffer will not move any more
+	for (size_t i = 0; i < listing.items.size(); ++i)
+		listing.items[i].name = PathView(listing.names.data() + offsets[i], listing.items[i].name.size());
+	{
+		lock_guard lock(mtx);
+		for (auto& sub : subdirs)
+			listings.emplace(sub->dir, sub);
+		listing.bytes = listing.items.capacity() * sizeof(DirItem) + listing.names.capacity() * sizeof(PathChar);
+		ahead += listing.bytes;
+		queued += subdirs.size();
+		listing.state = Done;
+	}
+	if (!subdirs.empty()) {
+		// first subdirectory is needed first, so it must be on the back of the queue
+		WorkQueue& q = *queues[ix];
+		lock_guard lock(q.mtx);
+		for (auto it = subdirs.rbegin(); it != subdirs.rend(); ++it)
+			q.tasks.push_back(move(*it));
+	}
+	cv_done.notify_all();
+	cv_work.notify_all();
+}
+
+void ParallelLister::Drop(const DirItem& dir)
+{
+	Drop(Key{ dir.parent, PathString(dir.name) });
+}
+
+void ParallelLister::Drop(Key key)
+{
+	ListingPtr listing;
+	{
+		lock_guard lock(mtx);
+		auto it = listings.find(key);
+		if (it == listings.end()) // excluded, it is not scheduled
+			return;
+		listing = move(it->second);
+		listings.erase(it);
+	}
+	int expected = Queued;
+	if (!listing->state.compare_exchange_strong(expected, Done)) { // started, the worker skips it otherwise
+		{
+			unique_lock lock(mtx);
+			cv_done.wait(lock, [&] { return listing->state == Done; });
+			ahead -= listing->bytes;
+		}
+		cv_work.notify_all();
+		for (auto& it : listing->items) {
+			if (it.type == DirItem::Dir)
+				Drop(Key{ it.parent, PathString(it.name) });
+		}
+	}
+	paths.Release(listing->ix);
+}
+
+Coro::generator<DirItem> ParallelLister::get_files(DirItem dir, uint32_t& ix)
+{
+	Key key{ dir.parent, PathString(dir.name) };
+	ListingPtr listing;
+	{
+		lock_guard lock(mtx);
+		if (auto it = listings.find(key); it != listings.end()) {
+			listing = move(it->second);
+			listings.erase(it);
+		}
+	}
+	if (!listing) { // not scheduled: root directory
+		listing = make_shared<Listing>();
+		listing->dir = move(key);
+		listing->ix = paths.Add(dir);
+	}
+	ix = listing->ix;
+	int expected = Queued;
+	if (listing->state.compare_exchange_strong(expected, Running)) // not started yet, do it now
+		List(*listing, queues.size() - 1);
+	else {
+		unique_lock lock(mtx);
+		cv_done.wait(lock, [&] { return listing->state == Done; });
+	}
+	{
+		lock_guard lock(mtx);
+		ahead -= listing->bytes;
+	}
+	cv_work.notify_all();
+	if (listing->error)
+		rethrow_exception(listing->error);
+
+	for (auto& it : listing->items)
+		co_yield it;
+}
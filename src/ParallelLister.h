@@ -0,0 +1,100 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <filesystem>
+
+#include "CommonFunc.h"
+#include "PathTable.h"
+#include "MemoryBudget.h"
+
+// Lists directories ahead of the archiver on several threads.
+// Every listed directory schedules its subdirectories, idle threads steal them from each other.
+// get_files() returns items of the directory in the same order as ::get_files(),
+// so the archive is the same as with the serial walk.
+class ParallelLister
+{
+public:
+	// threads - number of listing threads, max_ahead - max bytes of items and names listed but not taken yet,
+	// it is taken from the memory budget
+	ParallelLister(PathTable& paths, unsigned threads, const std::vector<std::wstring>& exclude, size_t max_ahead = 64 * 1024 * 1024);
+	~ParallelLister();
+	ParallelLister(const ParallelLister&) = delete;
+	ParallelLister& operator=(const ParallelLister&) = delete;
+
+	// 'ix' is set to the index of the directory in PathTable when listing starts, the caller releases it
+	Coro::generator<DirItem> get_files(DirItem dir, uint32_t& ix);
+	// the directory is skipped by the consumer: its listing is cancelled or forgotten with its subdirectories
+	void Drop(const DirItem& dir);
+
+protected:
+	enum State { Queued, Running, Done };
+	struct Key // directory: parent index and name
+	{
+		uint32_t parent;
+		PathString name;
+		bool operator==(const Key& other) const { return parent == other.parent && name == other.name; }
+	};
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const { return std::hash<PathString>()(key.name) ^ key.parent; }
+	};
+	struct Listing
+	{
+		Key dir;
+		uint32_t ix;                // of the directory in PathTable
+		std::vector<DirItem> items; // names point to 'names'
+		PathString names;           // zero-terminated names of items
+		size_t bytes = 0;           // of items and names
+		std::exception_ptr error;
+		std::atomic<int> state = Queued;
+	};
+	using ListingPtr = std::shared_ptr<Listing>;
+	struct WorkQueue
+	{
+		std::mutex mtx;
+		std::deque<ListingPtr> tasks; // owner takes from the back, others steal from the front
+	};
+
+	void WorkerThread(size_t ix);
+	ListingPtr TakeTask(size_t ix);
+	void List(Listing& listing, size_t ix);
+	void Drop(Key key);
+
+	PathTable& paths;
+	std::vector<std::wstring> exclude;
+	MemoryBudget::Share share;
+	size_t max_ahead;
+	std::vector<std::unique_ptr<WorkQueue>> queues; // last one belongs to the consumer
+	std::vector<std::thread> threads;
+
+	std::mutex mtx; // protects listings, ahead, queued, stop
+	std::condition_variable cv_work;  // a task is queued, or space is available
+	std::condition_variable cv_done;  // a listing is done
+	std::unordered_map<Key, ListingPtr, KeyHash> listings; // scheduled and not taken by consumer
+	size_t ahead = 0;   // bytes of listings done but not taken
+	size_t queued = 0;  // tasks in queues
+	bool stop = false;
+};
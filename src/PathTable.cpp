@@ -0,0 +1,127 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#include "pch.h"
+#include "PathTable.h"
+#include <bit>
+
+using namespace std;
+
+namespace
+{
+	const PathChar Separator = L'\\';
+	bool IsSeparator(PathChar ch) { return ch == L'\\' || ch == L'/'; }
+}
+
+PathView DirItem::filename() const
+{
+	if (parent != NoParent)
+		return name;
+	size_t pos = name.size();
+	while (pos > 0 && !IsSeparator(name[pos - 1]))
+		--pos;
+	return name.substr(pos);
+}
+
+uint32_t PathTable::Add(uint32_t parent, PathView name)
+{
+	const size_t BlockSize = 64 * 1024;
+	lock_guard lock(mtx);
+	if (name.size() > arena_free) {
+		arena_block = max(BlockSize, name.size());
+		arena.push_back(make_unique<PathChar[]>(arena_block));
+		arena_free = arena_block;
+	}
+	PathChar* dst = arena.back().get() + (arena_block - arena_free);
+	name.copy(dst, name.size());
+	arena_free -= name.size();
+
+	uint32_t dir;
+	if (!free_nodes.empty()) {
+		dir = free_nodes.back();
+		free_nodes.pop_back();
+	}
+	else {
+		dir = count++;
+		size_t k = bit_width(dir / FirstChunk + 1) - 1;
+		if (!chunks[k])
+			chunks[k] = make_unique<Node[]>((size_t)FirstChunk << k);
+	}
+	Node& node = At(dir);
+	node.parent = parent;
+	node.refs = 1;
+	node.len = (uint32_t)name.size();
+	node.name = dst;
+	if (parent != DirItem::NoParent)
+		++At(parent).refs;
+	return dir;
+}
+
+void PathTable::Release(uint32_t dir)
+{
+	lock_guard lock(mtx);
+	while (dir != DirItem::NoParent) {
+		Node& node = At(dir);
+		if (--node.refs > 0)
+			break;
+		free_nodes.push_back(dir);
+		dir = node.parent;
+	}
+}
+
+PathTable::Node& PathTable::At(uint32_t dir) const
+{
+	size_t k = bit_width(dir / FirstChunk + 1) - 1;
+	return chunks[k][dir - FirstChunk * ((1u << k) - 1)];
+}
+
+void PathTable::AppendPath(uint32_t dir, PathString& out) const
+{
+	const Node& node = At(dir);
+	if (node.parent != DirItem::NoParent) {
+		AppendPath(node.parent, out);
+		if (!out.empty() && !IsSeparator(out.back()))
+			out += Separator;
+	}
+	out.append(node.name, node.len);
+}
+
+const PathChar* PathTable::FullPath(uint32_t dir, PathString& out) const
+{
+	out.clear();
+	AppendPath(dir, out);
+	return out.c_str();
+}
+
+const PathChar* PathTable::FullPath(const DirItem& item, PathString& out) const
+{
+	out.clear();
+	if (item.parent != DirItem::NoParent) {
+		AppendPath(item.parent, out);
+		if (!out.empty() && !IsSeparator(out.back()))
+			out += Separator;
+	}
+	out += item.name;
+	return out.c_str();
+}
+
+filesystem::path PathTable::Path(const DirItem& item) const
+{
+	PathString out;
+	FullPath(item, out);
+	return out;
+}
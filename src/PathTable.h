@@ -0,0 +1,66 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include "CommonFunc.h"
+
+// Directories met during the walk: each one keeps the index of its parent and its name in a shared arena.
+// DirItem refers to its directory by index, full paths are built only when a system call needs them.
+// Can be filled and read from several threads: nodes do not move and are not changed while they are used,
+// so paths are read without locking. A directory is released when its items are written,
+// its node is reused after its subdirectories are released too; names of released nodes stay in the arena.
+class PathTable
+{
+public:
+	// registers directory 'name' in 'parent' (DirItem::NoParent if name is the full path)
+	uint32_t Add(uint32_t parent, PathView name);
+	uint32_t Add(const DirItem& dir) { return Add(dir.parent, dir.name); }
+	// the directory is not needed any more, DirItem::NoParent is ignored
+	void Release(uint32_t dir);
+	// writes full path of directory to 'out' and returns it
+	const PathChar* FullPath(uint32_t dir, PathString& out) const;
+	// writes full path of item to 'out' and returns it
+	const PathChar* FullPath(const DirItem& item, PathString& out) const;
+	std::filesystem::path Path(const DirItem& item) const;
+
+protected:
+	struct Node
+	{
+		uint32_t parent;
+		uint32_t refs;   // 1 until released, and 1 for each registered subdirectory
+		uint32_t len;
+		const PathChar* name; // in arena
+	};
+	// chunk k has FirstChunk << k nodes, chunks are never moved
+	static constexpr uint32_t FirstChunk = 1024;
+	static constexpr size_t MaxChunks = 23;
+	Node& At(uint32_t dir) const;
+	void AppendPath(uint32_t dir, PathString& out) const;
+
+	std::mutex mtx; // protects adding and releasing
+	std::unique_ptr<Node[]> chunks[MaxChunks];
+	uint32_t count = 0; // nodes in use or free
+	std::vector<uint32_t> free_nodes;
+	std::vector<std::unique_ptr<PathChar[]>> arena; // blocks of names, never moved
+	size_t arena_block = 0; // size of the last block
+	size_t arena_free = 0;  // free chars in the last block
+};
@@ -0,0 +1,122 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#include "pch.h"
+#include "Prefetcher.h"
+#include "FileSimple.h"
+
+#include <algorithm>
+
+using namespace std;
+
+Prefetcher::Prefetcher(unsigned nthreads, size_t max_files, ULONGLONG max_bytes)
+	: max_files(max_files), share(0, (size_t)max_bytes), max_bytes(share.Size())
+{
+	for (unsigned i = 0; i < nthreads; ++i)
+		threads.emplace_back(&Prefetcher::WorkerThread, this);
+}
+
+Prefetcher::~Prefetcher()
+{
+	{
+		lock_guard lock(mtx);
+		stop = true;
+	}
+	cv_work.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+Prefetcher::FilePtr Prefetcher::Schedule(PathString path, ULONGLONG size)
+{
+	if (size > max_bytes / 4) // big files are read in place, their open latency does not matter
+		return nullptr;
+	auto file = make_shared<File>();
+	file->path = move(path);
+	file->size = size;
+	{
+		lock_guard lock(mtx);
+		if (files >= max_files || bytes + size > max_bytes)
+			return nullptr;
+		while (bytes + pooled + size > max_bytes) { // buffers of the pool are freed to stay within max_bytes
+			pooled -= pool.back().capacity();
+			pool.pop_back();
+		}
+		++files;
+		bytes += size;
+		tasks.push_back(file);
+	}
+	cv_work.notify_one();
+	return file;
+}
+
+void Prefetcher::Wait(const File& file)
+{
+	unique_lock lock(mtx);
+	cv_done.wait(lock, [&] { return file.done; });
+}
+
+void Prefetcher::Release(FilePtr& file)
+{
+	lock_guard lock(mtx);
+	--files;
+	bytes -= max(file->size, (ULONGLONG)file->data.capacity());
+	if (pool.size() < max_files && file->data.capacity() != 0) {
+		pooled += file->data.capacity();
+		pool.push_back(move(file->data));
+	}
+	file.reset();
+}
+
+void Prefetcher::WorkerThread()
+{
+	for (;;) {
+		FilePtr file;
+		vector<BYTE> buf;
+		{
+			unique_lock lock(mtx);
+			cv_work.wait(lock, [this] { return stop || !tasks.empty(); });
+			if (stop)
+				return;
+			file = move(tasks.front());
+			tasks.pop_front();
+			if (!pool.empty()) {
+				buf = move(pool.back());
+				pooled -= buf.capacity();
+				pool.pop_back();
+				if (buf.capacity() < file->size) // a new one is allocated of the exact size
+					buf = vector<BYTE>();
+				else
+					bytes += buf.capacity() - file->size; // counted instead of the size
+			}
+		}
+		buf.resize((size_t)file->size);
+		FileSimple fs(file->path.c_str());
+		bool ok = fs.IsOpen() && fs.Read(buf.data(), (DWORD)buf.size()) == buf.size(); // errors are reported when written
+		FileId link;
+		bool linked = ok && hard_link_id(fs.Handle(), link);
+		{
+			lock_guard lock(mtx);
+			file->data = move(buf);
+			file->ok = ok;
+			file->linked = linked;
+			file->link = link;
+			file->done = true;
+		}
+		cv_done.notify_all();
+	}
+}
@@ -0,0 +1,79 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "CommonFunc.h"
+#include "MemoryBudget.h"
+
+// Reads files ahead of the archiver on several threads into pooled buffers.
+// The archiver schedules files in its order and takes them in the same order,
+// so open and first read latency of network drives is hidden.
+class Prefetcher
+{
+public:
+	struct File
+	{
+		PathString path;
+		ULONGLONG size = 0;
+		std::vector<BYTE> data;
+		bool ok = false;   // data contains the whole file
+		bool linked = false; // the file has several names (hard links), link is its id
+		FileId link = {};
+		bool done = false; // reading is finished
+	};
+	using FilePtr = std::shared_ptr<File>;
+
+	// max_files and max_bytes - limits of files scheduled and not released yet,
+	// max_bytes is taken from the memory budget and includes buffers of the pool
+	Prefetcher(unsigned threads, size_t max_files, ULONGLONG max_bytes);
+	~Prefetcher();
+	Prefetcher(const Prefetcher&) = delete;
+	Prefetcher& operator=(const Prefetcher&) = delete;
+
+	// queues reading of the file, returns nullptr if a limit is reached (the file is to be read in place)
+	FilePtr Schedule(PathString path, ULONGLONG size);
+	// waits until the file is read
+	void Wait(const File& file);
+	// returns the buffer to the pool
+	void Release(FilePtr& file);
+
+protected:
+	void WorkerThread();
+
+	size_t max_files;
+	MemoryBudget::Share share;
+	ULONGLONG max_bytes;
+	std::vector<std::thread> threads;
+
+	std::mutex mtx; // protects all below
+	std::condition_variable cv_work; // a file is scheduled
+	std::condition_variable cv_done; // a file is read
+	std::deque<FilePtr> tasks;
+	std::vector<std::vector<BYTE>> pool; // buffers of released files
+	size_t files = 0;     // scheduled and not released
+	ULONGLONG bytes = 0;  // their size (capacity of buffers when they are read)
+	ULONGLONG pooled = 0; // capacity of buffers in the pool
+	bool stop = false;
+};
@@ -10,17 +10,54 @@
 #include "aes.h"
 #include "shaker.h"
 #include "sha1.h"
+#include "lz.h"
+#include "ParallelLister.h"
+#include "PathTable.h"
+#include "Prefetcher.h"
+#include "WorkQueue.h"
+#include "ChangeWatcher.h"
+#include "Throttle.h"
+#include "MemoryBudget.h"
 #include <tchar.h>
 #include <iostream>
 #include <random>
 #include <ratio>
 #include <chrono>
+#include <algorithm>
+#include <tuple>
+#include <deque>
+#include <map>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <optional>
+#include <functional>
+#include <cwctype>
+#include <cmath>
 
 using namespace std;
 using namespace std::chrono;
 
+static const char BeginDir = 'D'; // DirItem info, files, EndDir
+static const char BeginFile = 'F'; // DirItem info, data, streams, EndFile
+static const char BeginStream = 'S'; // DirItem info, data
+static const char BeginLink = 'L'; // DirItem info, path of the item with the same file (hard link), no data and no end
+static const char UnchangedFile = 'U'; // DirItem info of a file which is the same as in the base archive, no data and no end
+static const char DeletedItem = 'X'; // name of an item of the base archive which does not exist anymore, no end
+static const char DeltaFile = 'P'; // DirItem info, changes against the file in the base archive (see WriteDelta), streams, EndFile
+static const char EndFile = 'f';
+static const char EndDir = 'd';
+static const char EndArchive = 'a';
+static const char FormatHeader = 'H'; // format flags (BYTE), the first record of tar data if present
+static const BYTE FormatCompact = 1;  // compact headers, see CompactHeaders
+
 namespace
 {
+	// fields of DirItem info in the header of item
+	bool HasSize(char type) { return type != BeginDir && type != DeletedItem; }
+	bool HasFileInfo(char type) { return type == BeginFile || type == UnchangedFile || type == DeltaFile; } // attributes and time
+	bool HasEnd(char type) { return type == BeginDir || type == BeginFile || type == DeltaFile; } // EndDir or EndFile follows
+
 	int ShowHelpTar(filesystem::path filename)
 	{
 		ShowCopyright();
@@ -31,8 +68,26 @@ namespace
 		wcout << L"Default file extension of tar-file is .star\n";
 		wcout << L"options:\n";
 		wcout << L"  /t             - test: valid console output but tar-file is not created\n";
+		wcout << L"  /t:s           - only estimate upper bound of tar-file size from directory listings, files are not read\n";
 		wcout << L"  /p:password    - password to encrypt tar-file\n";
 		wcout << L"  /e:mask1;mask2 - masks to exclude files or directories\n";
+		wcout << L"  /j:threads     - list directories ahead on several threads (slow or network drives)\n";
+		wcout << L"  /r             - read files in the order of their placement on disk (HDD, fragmented volumes)\n";
+		wcout << L"  /a:threads     - read files ahead on several threads (network drives), /r is ignored\n";
+		wcout << L"  /h             - compact headers of items (many small files)\n";
+		wcout << L"  /c:threads     - encrypt independent frames on several threads, needs /p\n";
+		wcout << L"  /z             - compress (fast), /z:h - compress better but slower, /z:threads or /z:h,threads\n";
+		wcout << L"  /d             - store repeated chunks of data once, /d:size - memory for chunk index (256M)\n";
+		wcout << L"  /g:base        - incremental: only files changed since tar-file 'base' (same password)\n";
+		wcout << L"  /x             - extend: append items to existing tar-file, not framed, compressed or deduplicated\n";
+		wcout << L"  /b             - keep block signatures of files of 4M or more, /g stores only their changed blocks\n";
+		wcout << L"  /w             - watch: then write changed items every 10 seconds in <tar-file>.0001 etc., /w:seconds\n";
+		wcout << L"  /k             - save checkpoints every minute in <tar-file>.ckpt, /k:seconds; not with /c, /z, /d\n";
+		wcout << L"  /u             - resume interrupted tar-file from its checkpoint (the same items and options)\n";
+		wcout << L"  /n             - background: low CPU and disk priority\n";
+		wcout << L"  /n:r,w,o       - also limit bytes read, bytes written and files opened per second (20M,10M,100)\n";
+		wcout << L"  /n:@file       - the limits are in the file, it is read again when it changes\n";
+		wcout << L"  /q:size        - memory budget for buffers of all stages (e.g. 256M), queues wait within it\n";
 		return 0;
 	}
 
@@ -45,8 +100,18 @@ namespace
 		wcout << L"options:\n";
 		wcout << L"  /t             - test: only list directories, files and streams\n";
 		wcout << L"  /o             - overwrite existing files\n";
+		wcout << L"  /s             - sync: skip existing files with the same size and time, overwrite others\n";
+		wcout << L"  /s:v           - sync with verification: compare contents, write only differing parts\n";
 		wcout << L"  /p:password    - password to decrypt tar-file\n";
 		wcout << L"  /f:sym         - write streams as files, sym replaces ':'\n";
+		wcout << L"  /i:path1;path2 - extract only these directories and files (paths in tar-file)\n";
+		wcout << L"  /m:mask1;mask2 - extract only items whose names or paths in tar-file match masks\n";
+		wcout << L"  /c:threads     - decrypt frames and decompress on several threads, default: all cores\n";
+		wcout << L"  /g:base1;inc1  - restore increment: extract the base and older increments first\n";
+		wcout << L"  /k             - save checkpoints every minute in <dir>\\<tar-file>.ckpt, /k:seconds\n";
+		wcout << L"  /u             - resume interrupted extraction from its checkpoint\n";
+		wcout << L"  /n             - background: low CPU and disk priority, /n:r,w,o and /n:@file - limits as for tar\n";
+		wcout << L"  /q:size        - memory budget for buffers of all stages (e.g. 256M), queues wait within it\n";
 		return 0;
 	}
 
@@ -73,6 +138,15 @@ namespace
 
 
 
+	// at the end of tar and untar
+	void PrintPeakMemory()
+	{
+		wcout << L"Peak memory " << FileSizeStr(PeakProcessMemory()) << L" bytes";
+		if (MemoryBudget::Limit())
+			wcout << L", buffers " << FileSizeStr(MemoryBudget::Peak()) << L" of budget " << FileSizeStr(MemoryBudget::Limit()) << L" bytes";
+		wcout << endl;
+	}
+
 	template<class T>
 	wostream& operator<<(wostream& o, const vector<T>& v)
 	{
@@ -104,6 +178,9 @@ namespace
 		virtual void Write(const void* buf, DWORD size) = 0;
 		virtual bool IsMyFile(const filesystem::path& path, bool is_stream) { return false; }
 		virtual void Flush() {}
+		virtual void Count(ULONGLONG size) { written_total += size; } // accounts data which is not written (size estimation)
+		virtual void Incompressible(bool on) {} // data written until Incompressible(false) is not worth compressing
+		virtual void DataBoundary() {} // data of an item begins or ends here
 		ULONGLONG written_total = 0;
 		template<typename T>
 		void Write(const T& t) { Write(&t, sizeof(T)); }
@@ -116,6 +193,7 @@ namespace
 		ULONGLONG written_current = 0;
 		DWORD current_part = 0;
 		bool write_to_stream;
+		ULONGLONG kept = 0;   // bytes of existing file which are continued
 		FileSimple fs;
 	public:
 		TarWriterFiles(filesystem::path name, ULONGLONG part_size)
@@ -131,6 +209,22 @@ namespace
 			std::error_code ec;
 			return filesystem::equivalent(name, path, ec);
 		}
+		// continues existing file: its first 'size' bytes are kept, the rest is cut off
+		void Append(ULONGLONG size)
+		{
+			if (!fs.OpenRW(name.c_str()))
+				throw MyException{ L"Failed to open '<path>': <err>", name.c_str(), GetLastError() };
+			if (!fs.Seek((LONGLONG)size, FILE_BEGIN) || !fs.SetEOF())
+				throw MyException{ L"Failed to write to '<path>': <err>", name.c_str(), GetLastError() };
+			kept = size;
+		}
+		// data written so far is on the disk, returns the size of the file (checkpoint)
+		ULONGLONG Sync()
+		{
+			if (fs.IsOpen() && !FlushFileBuffers(fs.Handle()))
+				throw MyException{ L"Failed to write to '<path>': <err>", name.c_str(), GetLastError() };
+			return kept + written_total;
+		}
 		virtual void Write(const void* buf, DWORD size) override
 		{
 			if (!fs.IsOpen()) {
@@ -159,6 +253,276 @@ namespace
 		}
 	};
 
+	// Index of the archive is written after EndArchive: records of fixed size, block of names, block signatures
+	// (see BlockSum), padding, trailer.
+	// Names are UTF-8 as in headers and front coded: a record keeps only the part which differs from the name
+	// of the previous record, every RestartInterval-th name is kept whole to decode any name quickly.
+	// Tar data with the index is padded to 32 bytes, so the ciphers add nothing and the trailer
+	// is found at the end of tar data by the size of tar-file.
+	const char IndexMagic[8] = { 'S', 'T', 'A', 'R', 'I', 'D', 'X', '1' };
+	const DWORD IndexNoParent = 0xFFFFFFFF;
+	const size_t RestartInterval = 16;
+	const BYTE IndexIncompressible = 1; // data of the item is stored without compression
+	const BYTE IndexSums = 2;           // block signatures of the file follow the names block
+
+	struct IndexRecord
+	{
+		ULONGLONG offset;     // of the item header in tar data
+		ULONGLONG size;
+		FILETIME time;        // for directory - time base of compact headers inside of it
+		DWORD attributes;
+		DWORD parent;         // record of directory or file (for streams) containing the item, IndexNoParent
+		DWORD name;           // offset of the name suffix in names block
+		WORD prefix;          // bytes shared with the name of the previous record
+		WORD suffix;          // bytes of the name suffix
+		char type;            // BeginDir, BeginFile, BeginStream, BeginLink, UnchangedFile, DeletedItem, DeltaFile
+		BYTE flags;           // IndexIncompressible, IndexSums
+		char reserved[6];
+	};
+	static_assert(sizeof(IndexRecord) == 48);
+
+	struct IndexTrailer
+	{
+		char magic[8];
+		ULONGLONG offset;     // of the index in tar data
+		ULONGLONG count;      // of records
+		ULONGLONG names;      // size of names block
+	};
+	static_assert(sizeof(IndexTrailer) == 32);
+
+	// Block signatures of big files (tar /b) are kept in the index after the names block, in the order of records
+	// having IndexSums: one per DeltaBlock of data, the last one can be shorter. An incremental archive stores
+	// such files as changes against their version in the base (DeltaFile), the blocks are found as in rsync.
+	const ULONGLONG DeltaMinSize = 4 * 1024 * 1024;
+	const DWORD DeltaBlock = 64 * 1024;
+
+	struct BlockSum
+	{
+		uint32_t weak;        // RollingSum
+		uint8_t strong[8];    // of SHA-1
+	};
+	static_assert(sizeof(BlockSum) == 12);
+
+	// weak sum of a window which moves by one byte
+	class RollingSum
+	{
+	public:
+		void Init(const BYTE* data, size_t size)
+		{
+			a = b = 0;
+			for (size_t i = 0; i < size; ++i) {
+				a += data[i];
+				b += a;
+			}
+		}
+		void Roll(BYTE out, BYTE in, size_t size)
+		{
+			a += in - out;
+			b += a - uint32_t(size * out);
+		}
+		uint32_t Value() const { return a ^ (b * 2654435761u); }
+	protected:
+		uint32_t a = 0; // sum of bytes
+		uint32_t b = 0; // sum of bytes weighted by their distance to the end of window
+	};
+
+	BlockSum MakeBlockSum(const BYTE* data, size_t size)
+	{
+		BlockSum sum;
+		RollingSum rs;
+		rs.Init(data, size);
+		sum.weak = rs.Value();
+		auto digest = sha1_digest(data, (unsigned)size);
+		memcpy(sum.strong, digest.data(), sizeof(sum.strong));
+		return sum;
+	}
+
+	// signatures of the data given in order
+	class BlockSummer
+	{
+	public:
+		void Add(const BYTE* data, size_t size)
+		{
+			while (size) {
+				if (block.empty() && size >= DeltaBlock) {
+					sums.push_back(MakeBlockSum(data, DeltaBlock));
+					data += DeltaBlock;
+					size -= DeltaBlock;
+					continue;
+				}
+				size_t part = min<size_t>(size, DeltaBlock - block.size());
+				block.insert(block.end(), data, data + part);
+				data += part;
+				size -= part;
+				if (block.size() == DeltaBlock) {
+					sums.push_back(MakeBlockSum(block.data(), block.size()));
+					block.clear();
+				}
+			}
+		}
+		vector<BlockSum> Finish()
+		{
+			if (!block.empty())
+				sums.push_back(MakeBlockSum(block.data(), block.size()));
+			block.clear();
+			return move(sums);
+		}
+	protected:
+		vector<BlockSum> sums;
+		vector<BYTE> block; // incomplete block
+	};
+
+	class ITarReader;
+
+	// the first writer of the chain: counts position in tar data and collects the index
+	class TarWriterIndex : public ITarWriter
+	{
+	public:
+		TarWriterIndex(unique_ptr<ITarWriter>&& dst)
+			: dst(move(dst))
+		{
+		}
+		virtual void Write(const void* buf, DWORD size) override
+		{
+			position += size;
+			if (keep_recent) {
+				recent.insert(recent.end(), (const uint8_t*)buf, (const uint8_t*)buf + size);
+				if (recent.size() > 2 * keep_recent)
+					recent.erase(recent.begin(), recent.end() - keep_recent);
+			}
+			dst->Write(buf, size);
+		}
+		virtual void Count(ULONGLONG size) override
+		{
+			position += size;
+			dst->Count(size);
+		}
+		virtual bool IsMyFile(const filesystem::path& path, bool is_stream) { return dst->IsMyFile(path, is_stream); }
+		virtual void Flush()  override { dst->Flush(); }
+		virtual void Incompressible(bool on) override
+		{
+			if (on && !records.empty())
+				records.back().flags |= IndexIncompressible;
+			dst->Incompressible(on);
+		}
+		virtual void DataBoundary() override { dst->DataBoundary(); }
+
+		// is called before the header of item is written, time_base - see IndexRecord::time
+		void BeginItem(char type, const DirItem& di, string_view name, ULONGLONG time_base)
+		{
+			// names are found by DWORD offsets and parents by DWORD numbers, IndexNoParent is not a record
+			if (names.size() > 0xFFFFFFFF || records.size() >= IndexNoParent)
+				throw MyException{ L"Too many items for the index of tar-file", L"", 0 };
+			IndexRecord rec = {};
+			rec.offset = position;
+			rec.type = type;
+			rec.parent = parents.empty() ? IndexNoParent : parents.back();
+			if (HasSize(type))
+				rec.size = di.size;
+			if (HasFileInfo(type)) {
+				rec.attributes = di.dwFileAttributes;
+				rec.time = di.ftLastWriteTime;
+			}
+			else if (type == BeginDir)
+				rec.time = FILETIME{ DWORD(time_base), DWORD(time_base >> 32) };
+			size_t prefix = 0;
+			if (records.size() % RestartInterval != 0)
+				while (prefix < name.size() && prefix < last_name.size() && name[prefix] == last_name[prefix])
+					++prefix;
+			rec.prefix = (WORD)prefix;
+			rec.suffix = (WORD)(name.size() - prefix);
+			rec.name = (DWORD)names.size();
+			names.append(name.substr(prefix));
+			last_name.assign(name);
+			if (HasEnd(type))
+				parents.push_back((DWORD)records.size());
+			records.push_back(rec);
+		}
+		// block signatures of the data of the last item (file), is called before its streams
+		void AddSums(const vector<BlockSum>& file_sums)
+		{
+			records.back().flags |= IndexSums;
+			sums.insert(sums.end(), file_sums.begin(), file_sums.end());
+		}
+		// continues the index of existing tar data which ends at 'end' (before EndArchive)
+		void Resume(vector<IndexRecord>&& old_records, string&& old_names, vector<BlockSum>&& old_sums,
+			string&& old_last_name, ULONGLONG end)
+		{
+			records = move(old_records);
+			names = move(old_names);
+			sums = move(old_sums);
+			last_name = move(old_last_name);
+			position = end;
+		}
+		// is called after EndDir or EndFile
+		void EndItem()
+		{
+			parents.pop_back();
+		}
+		// the position is between items of a directory, not inside of a file
+		bool InDirectory() const
+		{
+			return parents.empty() || records[parents.back()].type == BeginDir;
+		}
+
+		// Checkpoints (tar /k): the last 'size' bytes of tar data at least are kept to write them again
+		// after the last position where blocks of all ciphers end (see ResumeWriter)
+		void KeepRecent(size_t size)
+		{
+			keep_recent = size;
+		}
+		const vector<uint8_t>& Recent() const { return recent; }
+		// the state at the current position: open items and the recent data; the index itself is in the journal
+		void SaveState(ITarWriter* out) const;
+		void LoadState(ITarReader* in);
+		// the index only grows: the part added after the previous call is written to the journal of checkpoints
+		void SaveJournal(ITarWriter* out);
+		void LoadJournal(ITarReader* in);
+		// continues with the writer of the resumed tar-file (the index is constructed without it to load the state)
+		void SetDestination(unique_ptr<ITarWriter>&& writer)
+		{
+			dst = move(writer);
+		}
+		// paths in tar-file of the open directories, names of items in them and at the top which are written
+		void OpenItems(vector<wstring>& dirs, vector<set<wstring>>& done) const;
+		// is called after EndArchive
+		void WriteIndex()
+		{
+			IndexTrailer trailer = { {}, position, records.size(), names.size() };
+			memcpy(trailer.magic, IndexMagic, sizeof(IndexMagic));
+			WriteLarge(records.data(), records.size() * sizeof(IndexRecord));
+			WriteLarge(names.data(), names.size());
+			WriteLarge(sums.data(), sums.size() * sizeof(BlockSum));
+			const uint8_t zeros[32] = {};
+			Write(zeros, DWORD((32 - (position + sizeof(trailer)) % 32) % 32));
+			Write(&trailer, sizeof(trailer));
+		}
+
+		ULONGLONG position = 0; // in tar data
+	protected:
+		void WriteLarge(const void* buf, size_t size)
+		{
+			const uint8_t* ptr = (const uint8_t*)buf;
+			while (size) {
+				DWORD part = size < 0x10000000 ? (DWORD)size : 0x10000000;
+				Write(ptr, part);
+				ptr += part;
+				size -= part;
+			}
+		}
+		unique_ptr<ITarWriter> dst;
+		vector<IndexRecord> records;
+		string names;
+		vector<BlockSum> sums;
+		string last_name;
+		vector<DWORD> parents; // opened directories and file
+		vector<uint8_t> recent; // the last bytes of tar data, keep_recent .. 2 * keep_recent
+		size_t keep_recent = 0;
+		size_t journal_records = 0; // parts of the index which are in the journal
+		size_t journal_names = 0;
+		size_t journal_sums = 0;
+	};
+
 	class TarWriterBuffer : public ITarWriter
 	{
 	public:
@@ -202,10 +566,11 @@ namespace
 	class TarWriterAES : public ITarWriter
 	{
 	public:
-		TarWriterAES(unique_ptr<ITarWriter>&& dst, const uint8_t* key16, const uint8_t* init_iv = nullptr)
+		// write_iv = false - init_iv is the last ciphertext block written before (continued encryption)
+		TarWriterAES(unique_ptr<ITarWriter>&& dst, const uint8_t* key16, const uint8_t* init_iv = nullptr, bool write_iv = true)
 			: dst(move(dst)), aes(key16, init_iv)
 		{
-			if (init_iv)
+			if (init_iv && write_iv)
 			{
 				memcpy(data, init_iv, 16);
 				data_count = 16;
@@ -304,7 +669,20 @@ namespace
 	class ITarReader
 	{
 	public:
+		virtual ~ITarReader() {}
 		virtual void Read(void* buf, DWORD size) = 0;
+		virtual void Skip(ULONGLONG size) // skips data, derived classes can seek instead of reading
+		{
+			uint8_t buf[4 * 1024];
+			while (size) {
+				DWORD part = size < sizeof(buf) ? (DWORD)size : sizeof(buf);
+				Read(buf, part);
+				size -= part;
+			}
+		}
+		// size of the stage data in its source is given, returns the size of the data the stage gives
+		// (compression, deduplication), the reader is read to the end; false if the stage does not change it
+		virtual bool DataSize(ULONGLONG& size) { return false; }
 		template<typename T>
 		void Read(T& t) { Read(&t, sizeof(T)); }
 	};
@@ -338,6 +716,17 @@ namespace
 					throw MyException{ L"Failed to read '<path>': <err>", name, GetLastError() };
 			}
 		}
+		virtual void Skip(ULONGLONG size) override
+		{
+			DWORD in_buf = data_count - data_read;
+			if (in_buf >= size) {
+				data_read += (DWORD)size;
+				return;
+			}
+			data_count = data_read = 0;
+			if (!fs.Seek(LONGLONG(size - in_buf)))
+				throw MyException{ L"Failed to read '<path>': <err>", name, GetLastError() };
+		}
 	protected:
 		uint8_t data[4 * 1024];
 		DWORD data_count = 0; // bytes in buffer
@@ -353,11 +742,7 @@ namespace
 		}
 		virtual void Read(void* buf, DWORD size) override
 		{
-			if (read_iv) {
-				src->Read(data, 16);
-				aes.reset_iv(data);
-				read_iv = false;
-			}
+			ReadIV();
 			uint8_t* ptr = (uint8_t*)buf;
 			while (size) {
 				if (data_count >= size) {
@@ -376,7 +761,36 @@ namespace
 				data_count = 16;
 			}
 		}
+		virtual void Skip(ULONGLONG size) override
+		{
+			ReadIV();
+			if (data_count >= size) {
+				data_count -= (DWORD)size;
+				return;
+			}
+			size -= data_count;
+			data_count = 0;
+			// CBC: a block is decrypted with the previous ciphertext block as iv,
+			// so whole blocks are skipped in src and only the last of them is read
+			if (ULONGLONG blocks = size / 16) {
+				src->Skip((blocks - 1) * 16);
+				src->Read(data, 16);
+				aes.reset_iv(data);
+			}
+			if (DWORD rest = DWORD(size % 16)) {
+				uint8_t tail[16];
+				Read(tail, rest);
+			}
+		}
 	protected:
+		void ReadIV()
+		{
+			if (read_iv) {
+				src->Read(data, 16);
+				aes.reset_iv(data);
+				read_iv = false;
+			}
+		}
 		unique_ptr<ITarReader> src;
 		Aes128 aes;
 		bool read_iv = false;
@@ -411,6 +825,21 @@ namespace
 				data_count = 32;
 			}
 		}
+		virtual void Skip(ULONGLONG size) override
+		{
+			if (data_count >= size) {
+				data_count -= (DWORD)size;
+				return;
+			}
+			size -= data_count;
+			data_count = 0;
+			// blocks are shaken independently: whole ones are skipped in src, the last one is read
+			src->Skip(size / 32 * 32);
+			if (DWORD rest = DWORD(size % 32)) {
+				uint8_t tail[32];
+				Read(tail, rest);
+			}
+		}
 	protected:
 		unique_ptr<ITarReader> src;
 		Shaker shaker;
@@ -418,171 +847,1130 @@ namespace
 		DWORD data_count = 0;
 	};
 
-}
-
-static const char BeginDir = 'D'; // DirItem info, files, EndDir
-static const char BeginFile = 'F'; // DirItem info, data, streams, EndFile
-static const char BeginStream = 'S'; // DirItem info, data
-static const char EndFile = 'f';
-static const char EndDir = 'd';
-static const char EndArchive = 'a';
+	ULONGLONG FileTimeValue(const FILETIME& ft)
+	{
+		return (ULONGLONG)ft.dwHighDateTime << 32 | ft.dwLowDateTime;
+	}
 
-void WriteTarDirectory(ITarWriter* writer, const DirItem& item, const vector<wstring>& exclude, const filesystem::path& rel_path, const wstring& prefix);
-void WriteTarFile(ITarWriter* writer, const DirItem& item, const vector<wstring>& exclude, const filesystem::path& rel_path, const wstring& prefix);
-void WriteTarStream(ITarWriter* writer, const DirItem& item, const filesystem::path& rel_path, const wstring& prefix);
+	void WriteVarint(ITarWriter* writer, ULONGLONG value) // LEB128
+	{
+		uint8_t buf[10];
+		DWORD len = 0;
+		do {
+			buf[len++] = uint8_t(value & 0x7F) | (value > 0x7F ? 0x80 : 0);
+			value >>= 7;
+		} while (value);
+		writer->Write(buf, len);
+	}
 
-void TarFiles(ITarWriter* writer, Coro::generator<DirItem>&& items, const vector<wstring>& exclude,
-	const filesystem::path& rel_path, const wstring& prefix)
-{
-	for (auto& it : items)
+	ULONGLONG ReadVarint(ITarReader* reader)
 	{
-		if (mask_match(it.name.filename().c_str(), exclude))
-			continue;
-		switch (it.type)
-		{
-		case DirItem::Dir:
-			WriteTarDirectory(writer, it, exclude, rel_path, prefix);
-			break;
-		case DirItem::File:
-			WriteTarFile(writer, it, exclude, rel_path, prefix);
-			break;
-		case DirItem::Stream:
-			WriteTarStream(writer, it, rel_path, prefix);
-			break;
-		case DirItem::Invalid: {
-			// if filename is given in command line and does not exist or just deleted after being listed
-			ConsoleColor cc(FOREGROUND_RED);
-			wcout << prefix << L"* " << it.name.c_str() << L"  *** not found *** " << endl;
-		}
-							 break;
+		ULONGLONG value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			uint8_t b;
+			reader->Read(b);
+			value |= ULONGLONG(b & 0x7F) << shift;
+			if (!(b & 0x80))
+				return value;
 		}
+		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
 	}
-}
 
-void WriteDirItem(ITarWriter* writer, const DirItem& di)
-{
-	switch (di.type) {
-	case DirItem::Dir:
-		writer->Write(BeginDir);
-		break;
-	case DirItem::File:
-		writer->Write(BeginFile);
-		writer->Write(di.size);
-		writer->Write(di.dwFileAttributes);
-		writer->Write(di.ftLastWriteTime);
-		break;
-	case DirItem::Stream:
-		writer->Write(BeginStream);
-		writer->Write(di.size);
-		break;
-	default: return;
+	// string or vector of checkpoint state: LEB128 count, then elements
+	template<typename T>
+	void WriteItems(ITarWriter* writer, const T& items)
+	{
+		WriteVarint(writer, items.size());
+		const uint8_t* ptr = (const uint8_t*)items.data();
+		size_t size = items.size() * sizeof(items[0]);
+		while (size) {
+			DWORD part = size < 0x10000000 ? (DWORD)size : 0x10000000;
+			writer->Write(ptr, part);
+			ptr += part;
+			size -= part;
+		}
 	}
 
-	std::string name_utf8 = ToChar(di.name.filename().c_str(), CP_UTF8); // CP_ACP,
-	WORD wlen = (WORD)name_utf8.size();
-	writer->Write(wlen);
-	writer->Write(name_utf8.c_str(), wlen);
-}
-
-void WriteData(ITarWriter* writer, FileSimple& fs, ULONGLONG total, const filesystem::path& src)
-{
-	while (total != 0)
+	template<typename T>
+	void ReadItems(ITarReader* reader, T& items)
 	{
-		BYTE buf[64 * 1024];
-		SetLastError(0);
-		ULONGLONG to_read = sizeof(buf);
-		if (to_read > total)
-			to_read = total;
-		DWORD dwBytesRead = fs.Read(buf, (DWORD)to_read);
-		if (dwBytesRead != (DWORD)to_read)
-			throw MyException{ L"Failed to read '<path>': <err>", src.c_str(), GetLastError() };
-		writer->Write(buf, dwBytesRead);
-		total -= to_read;
+		ULONGLONG count = ReadVarint(reader);
+		if (count > (1ull << 40) / sizeof(items[0]))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		items.resize((size_t)count);
+		uint8_t* ptr = (uint8_t*)items.data();
+		size_t size = items.size() * sizeof(items[0]);
+		while (size) {
+			DWORD part = size < 0x10000000 ? (DWORD)size : 0x10000000;
+			reader->Read(ptr, part);
+			ptr += part;
+			size -= part;
+		}
 	}
-}
-
-void PrintFileData(const DirItem& item, const filesystem::path& rel_path, const wstring& prefix)
-{
-	WORD wColor =
-		item.type == DirItem::Stream ? FOREGROUND_GREEN | FOREGROUND_BLUE :
-		item.type == DirItem::Dir ? FOREGROUND_RED | FOREGROUND_GREEN :
-		FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
-	ConsoleColor cc(wColor);
-	//wcout << prefix << L"+ " << item.name.c_str() << endl;
-	//wcout << prefix << L"+ " << (rel_path / item.name.filename()).c_str() << endl;
-	auto sign = item.type == DirItem::Dir ? L"> " : L"+ ";
-	wcout << prefix << sign << item.name.filename().c_str();
-	//wcout << prefix << sign << item.name.c_str();
-	//wcout << prefix << sign << rel_path << L"   " << item.name.filename().c_str();
-	if (item.type != DirItem::Dir)
-		wcout << L"   " << item.size;
-	wcout << endl;
-}
-
-void WriteTarDirectory(ITarWriter* writer, const DirItem& item, const vector<wstring>& exclude,
-	const filesystem::path& rel_path, const wstring& prefix)
-{
-	PrintFileData(item, rel_path, prefix);
-	WriteDirItem(writer, item);
-	//	TarFiles(writer, directory_items(item.name), exclude, rel_path / item.name.filename(), prefix + L"  ");
-	TarFiles(writer, get_files(item.name), exclude, rel_path / item.name.filename(), prefix + L"  ");
-	//wcout << L"end " << item.c_str() << endl;
-	writer->Write(EndDir);
-}
 
+	// Compact headers (FormatCompact) follow the type of item instead of fixed fields:
+	// name as LEB128 length of the part shared with the previous name in the same directory (or file for streams),
+	// LEB128 length of the rest and the rest; size as LEB128; file attributes as index in the dictionary
+	// of common values (0 - value follows); file time as zigzag LEB128 difference with the previous file time
+	// in the directory, the first one in directory - with the time base of the parent.
+	// The state depends only on the parent directories and previous items in them, see TarIndex::HeaderState.
+	class CompactHeaders
+	{
+	public:
+		CompactHeaders(string last_name = {}, ULONGLONG time_base = 0)
+		{
+			levels.push_back({ move(last_name), time_base });
+		}
+		ULONGLONG TimeBase() const { return levels.back().time_base; }
 
-void WriteTarFile(ITarWriter* writer, const DirItem& item, const vector<wstring>& exclude, const filesystem::path& rel_path, const wstring& prefix)
-{
-	if (writer->IsMyFile(item.name, false)) // do not add tar itself to the tar
-		return;
+		// after the type of item
+		void Write(ITarWriter* writer, char type, const DirItem& di, string_view name)
+		{
+			Level& level = levels.back();
+			size_t prefix = 0;
+			while (prefix < name.size() && prefix < level.last_name.size() && name[prefix] == level.last_name[prefix])
+				++prefix;
+			WriteVarint(writer, prefix);
+			WriteVarint(writer, name.size() - prefix);
+			writer->Write(name.data() + prefix, DWORD(name.size() - prefix));
+			level.last_name.assign(name);
+			if (HasSize(type))
+				WriteVarint(writer, di.size);
+			if (HasFileInfo(type)) {
+				auto it = find(begin(Attributes), end(Attributes), di.dwFileAttributes);
+				WriteVarint(writer, it != end(Attributes) ? it - begin(Attributes) + 1 : 0);
+				if (it == end(Attributes))
+					WriteVarint(writer, di.dwFileAttributes);
+				ULONGLONG time = FileTimeValue(di.ftLastWriteTime);
+				LONGLONG delta = LONGLONG(time - level.time_base);
+				WriteVarint(writer, ULONGLONG(delta << 1) ^ ULONGLONG(delta >> 63));
+				level.time_base = time;
+			}
+			if (HasEnd(type))
+				levels.push_back({ {}, levels.back().time_base });
+		}
+		void Read(ITarReader* reader, char type, DirItem& di, string& name)
+		{
+			Level& level = levels.back();
+			ULONGLONG prefix = ReadVarint(reader);
+			ULONGLONG suffix = ReadVarint(reader);
+			if (prefix > level.last_name.size() || suffix > 500)
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			name.assign(level.last_name, 0, (size_t)prefix);
+			name.resize(size_t(prefix + suffix));
+			reader->Read(name.data() + prefix, (DWORD)suffix);
+			level.last_name = name;
+			di.size = HasSize(type) ? ReadVarint(reader) : 0;
+			if (HasFileInfo(type)) {
+				ULONGLONG attr = ReadVarint(reader);
+				if (attr > size(Attributes))
+					throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+				di.dwFileAttributes = attr ? Attributes[attr - 1] : (DWORD)ReadVarint(reader);
+				ULONGLONG zigzag = ReadVarint(reader);
+				ULONGLONG time = level.time_base + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+				di.ftLastWriteTime = FILETIME{ DWORD(time), DWORD(time >> 32) };
+				level.time_base = time;
+			}
+			if (HasEnd(type))
+				levels.push_back({ {}, levels.back().time_base });
+		}
+		// EndDir or EndFile
+		void End()
+		{
+			levels.pop_back();
+		}
+		// the state of all levels for checkpoints
+		void SaveState(ITarWriter* writer) const
+		{
+			WriteVarint(writer, levels.size());
+			for (auto& level : levels) {
+				WriteItems(writer, level.last_name);
+				WriteVarint(writer, level.time_base);
+			}
+		}
+		void LoadState(ITarReader* reader)
+		{
+			ULONGLONG count = ReadVarint(reader);
+			if (count == 0 || count > 0x10000)
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			levels.resize((size_t)count);
+			for (auto& level : levels) {
+				ReadItems(reader, level.last_name);
+				level.time_base = ReadVarint(reader);
+			}
+		}
 
-	PrintFileData(item, rel_path, prefix);
+	protected:
+		static constexpr DWORD Attributes[] = {
+			FILE_ATTRIBUTE_ARCHIVE, FILE_ATTRIBUTE_NORMAL, FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_READONLY,
+			FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_HIDDEN, FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM,
+			FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED, FILE_ATTRIBUTE_READONLY, 0,
+		};
+		struct Level
+		{
+			string last_name;     // UTF-8
+			ULONGLONG time_base;
+		};
+		vector<Level> levels;
+	};
 
-	FileSimple fs(item.name.c_str());
-	if (!fs.IsOpen())
+	void TarWriterIndex::SaveState(ITarWriter* out) const
 	{
-		ConsoleColor cc(FOREGROUND_RED);
-		wcout << prefix << L"* " << item.name.c_str() << L"  *** failed to open *** " << endl;
-		return;
+		out->Write(position);
+		WriteVarint(out, records.size());
+		WriteVarint(out, names.size());
+		WriteVarint(out, sums.size());
+		WriteItems(out, last_name);
+		WriteItems(out, parents);
+		WriteItems(out, recent);
 	}
-	WriteDirItem(writer, item);
-	// GetFileInformationByHandle  BY_HANDLE_FILE_INFORMATION
-	WriteData(writer, fs, item.size, item.name);
-	//	write streams
-	TarFiles(writer, get_streams(item.name, L""), exclude, rel_path, prefix);
-	writer->Write(EndFile);
-}
 
-wstring CorrectDirStreamName(const filesystem::path& str_path)
-{
-	wstring fn = str_path.c_str();
-	// directory name "dir\\:stream" -> "dir:stream"
-	// but ".\\:stream" is ok and -> ".:stream" is invalid
-	// ex1\..\:dirstr.tx3 is valid
-	// ex1\..:dirstr.tx4 is invalid
-	auto ix = fn.find(L"\\:");
-	if (ix != wstring::npos && !(ix > 0 && fn[ix - 1] == '.')) // ".\\:" is ok, "\\:" must be replaced
-		fn.erase(ix, 1);
-	return fn;
-}
+	void TarWriterIndex::LoadState(ITarReader* in)
+	{
+		in->Read(position);
+		// the index is loaded from the journal before
+		ULONGLONG count = ReadVarint(in);
+		ULONGLONG names_size = ReadVarint(in);
+		ULONGLONG sums_count = ReadVarint(in);
+		if (count != records.size() || names_size != names.size() || sums_count != sums.size())
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		journal_records = records.size();
+		journal_names = names.size();
+		journal_sums = sums.size();
+		ReadItems(in, last_name);
+		ReadItems(in, parents);
+		ReadItems(in, recent);
+		for (DWORD parent : parents) {
+			if (parent >= records.size() || !HasEnd(records[parent].type))
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		}
+	}
 
-void WriteTarStream(ITarWriter* writer, const DirItem& item, const filesystem::path& rel_path, const wstring& prefix)
-{
-	if (writer->IsMyFile(item.name, true)) // do not add tar itself to the tar
-		return;
+	void TarWriterIndex::SaveJournal(ITarWriter* out)
+	{
+		WriteItems(out, span<const IndexRecord>(records).subspan(journal_records));
+		WriteItems(out, string_view(names).substr(journal_names));
+		WriteItems(out, span<const BlockSum>(sums).subspan(journal_sums));
+		journal_records = records.size();
+		journal_names = names.size();
+		journal_sums = sums.size();
+	}
 
-	PrintFileData(item, rel_path, prefix);
+	void TarWriterIndex::LoadJournal(ITarReader* in)
+	{
+		vector<IndexRecord> more_records;
+		string more_names;
+		vector<BlockSum> more_sums;
+		ReadItems(in, more_records);
+		ReadItems(in, more_names);
+		ReadItems(in, more_sums);
+		records.insert(records.end(), more_records.begin(), more_records.end());
+		names += more_names;
+		sums.insert(sums.end(), more_sums.begin(), more_sums.end());
+	}
 
-	wstring fn = CorrectDirStreamName(item.name);
-	FileSimple fs(fn.c_str());
-	if (!fs.IsOpen())
+	void TarWriterIndex::OpenItems(vector<wstring>& dirs, vector<set<wstring>>& done) const
 	{
-		ConsoleColor cc(FOREGROUND_RED);
-		wcout << prefix << L"* " << fn << L"  *** failed to open *** " << endl;
-		return;
+		dirs.clear();
+		done.assign(parents.size() + 1, {});
+		map<DWORD, size_t> level; // open directory -> its level
+		for (size_t k = 0; k < parents.size(); ++k)
+			level[parents[k]] = k + 1;
+		string name_utf8;
+		wstring name;
+		for (size_t i = 0; i < records.size(); ++i) {
+			const IndexRecord& rec = records[i];
+			name_utf8.resize(rec.prefix);
+			name_utf8.append(names, rec.name, rec.suffix);
+			ToWideChar(name_utf8, CP_UTF8, name);
+			if (level.count((DWORD)i))
+				dirs.push_back(dirs.empty() ? name : (filesystem::path(dirs.back()) / name).wstring());
+			else if (rec.parent == IndexNoParent)
+				done[0].insert(name);
+			else if (auto it = level.find(rec.parent); it != level.end())
+				done[it->second].insert(name);
+		}
 	}
-	WriteDirItem(writer, item);
-	WriteData(writer, fs, item.size, item.name);
+
+}
+
+// items of the base archive of incremental one by their paths in tar-file, from its index
+class BaseManifest
+{
+public:
+	// returns false if tar-file has no index
+	bool Load(const wchar_t* tarname, const vector<wstring>& pw);
+	// the item of the base, IndexNoParent if there is no such; the item is marked as present
+	DWORD Find(const filesystem::path& path)
+	{
+		key = path.wstring();
+		for (auto& c : key)
+			c = towlower(c);
+		auto it = paths.find(key);
+		if (it == paths.end())
+			return IndexNoParent;
+		items[it->second].present = true;
+		return it->second;
+	}
+	// the file has the same size, time and attributes as in the base
+	bool Unchanged(const DirItem& item, const filesystem::path& path)
+	{
+		DWORD i = Find(path);
+		return i != IndexNoParent && HasFileInfo(items[i].type) && items[i].size == item.size &&
+			items[i].attributes == item.dwFileAttributes && CompareFileTime(&items[i].time, &item.ftLastWriteTime) == 0;
+	}
+	// block signatures of the file in the base (tar /b), null if it has none; size and time - of the file in the base
+	const vector<BlockSum>* Sums(const filesystem::path& path, ULONGLONG& size, FILETIME* time = nullptr)
+	{
+		DWORD i = Find(path);
+		if (i == IndexNoParent || items[i].sums.empty())
+			return nullptr;
+		size = items[i].size;
+		if (time)
+			*time = items[i].time;
+		return &items[i].sums;
+	}
+	// the file is written whole: it is changed and the base has no block signatures of it
+	bool WrittenWhole(const DirItem& item, const filesystem::path& path)
+	{
+		ULONGLONG size;
+		return !Unchanged(item, path) && !Sums(path, size);
+	}
+	// names of the items of directory (IndexNoParent - root) which are not found, UTF-8
+	vector<string> Deleted(DWORD dir) const
+	{
+		vector<string> names;
+		for (DWORD i : dir == IndexNoParent ? root : items[dir].children) {
+			if (!items[i].present)
+				names.push_back(items[i].name);
+		}
+		return names;
+	}
+protected:
+	struct Item
+	{
+		char type;
+		ULONGLONG size;
+		FILETIME time;
+		DWORD attributes;
+		string name;           // UTF-8
+		vector<DWORD> children;
+		vector<BlockSum> sums;
+		bool present = false;
+	};
+	vector<Item> items;        // directories and files, the same numbers as in the index
+	vector<DWORD> root;
+	unordered_map<wstring, DWORD> paths; // lowercase
+	wstring key;
+};
+
+// State of a long tar or untar which is saved every 'interval' seconds (tar /k, untar /k) to continue
+// after an interruption (/u). It is written to a temporary file which then replaces the previous one,
+// so one of them is whole whenever the work stops. The file is encrypted with the passwords of the tar-file.
+// Data which only grows (the index of tar) is appended to the journal (name.log) in blocks encrypted separately,
+// the state keeps the size of the journal: a save takes the time of the data added since the previous one.
+class Checkpoint
+{
+public:
+	Checkpoint(filesystem::path name, const vector<wstring>& pw, unsigned interval)
+		: name(move(name)), journal_name(filesystem::path(this->name) += L".log"), pw(pw), interval(interval),
+		next(steady_clock::now() + seconds(interval))
+	{
+	}
+	// saves the state if the interval is over
+	void Check()
+	{
+		if (steady_clock::now() >= next)
+			Save();
+	}
+	void Save();
+	// the reader of the saved state, the blocks of the journal are given to 'replay' before
+	unique_ptr<ITarReader> Load(FileSimple& fs, const function<void(ITarReader*)>& replay = nullptr);
+	// the work is complete
+	void Remove() const
+	{
+		error_code ec;
+		filesystem::remove(name, ec);
+		filesystem::remove(journal_name, ec);
+	}
+
+	const filesystem::path name;
+	function<void(ITarWriter*)> state;   // writes the state at the current position
+	function<void(ITarWriter*)> journal; // writes the data added since the previous save, if set
+protected:
+	void AppendJournal();
+
+	const filesystem::path journal_name;
+	ULONGLONG journal_size = 0; // of the blocks the saved state refers to
+	vector<wstring> pw;
+	unsigned interval;
+	steady_clock::time_point next;
+};
+
+// The walk of interrupted tar continues after its checkpoint (tar /u): items written before it are skipped,
+// the directories which were open are entered again without their headers.
+struct ResumePoint
+{
+	vector<wstring> dirs;      // paths in tar-file of the open directories, outer first
+	vector<set<wstring>> done; // names of the written items: at the top, then in each open directory
+	vector<bool> found;        // the open directory is listed again
+	vector<bool> entered;
+
+	// 0 - the top, k - inside of dirs[k - 1]; -1 if the walk at rel_path is not resumed
+	int Level(const filesystem::path& rel_path) const
+	{
+		if (rel_path.empty())
+			return 0;
+		for (size_t k = 0; k < dirs.size(); ++k) {
+			if (rel_path == dirs[k])
+				return int(k + 1);
+		}
+		return -1;
+	}
+};
+
+struct TarOptions
+{
+	vector<wstring> exclude;
+	PathTable* paths = nullptr;       // directories of the walk
+	ParallelLister* lister = nullptr; // lists directories ahead on several threads, if not null
+	Prefetcher* prefetcher = nullptr; // reads files ahead on several threads, if not null
+	bool physical_order = false;      // read files of a directory in the order of their data on disk
+	bool estimate = false;            // only count size of data, files are not opened and nothing is printed
+	TarWriterIndex* index = nullptr;  // the first writer of the chain
+	CompactHeaders* headers = nullptr; // FormatCompact, if not null
+	bool compress = false;            // tar data is compressed, incompressible files are detected
+	mutable map<FileId, string> links; // files having several names: path of the first archived name, UTF-8
+	mutable vector<FileId> links_added; // to links after the previous checkpoint
+	BaseManifest* base = nullptr;     // incremental archive: only changed files are written, if not null
+	bool sums = false;                // block signatures of big files are kept in the index
+	mutable ULONGLONG prefetched = 0; // bytes read ahead by all levels of the walk
+	ULONGLONG max_prefetched = 0;     // the limit of prefetched, the share of memory budget
+	mutable ULONGLONG unchanged = 0;  // files of base written as UnchangedFile
+	mutable ULONGLONG deleted = 0;    // items of base written as DeletedItem
+	mutable ULONGLONG delta = 0;      // bytes of changed files taken from their versions in base
+	Checkpoint* checkpoint = nullptr; // saves the state between items (tar /k), if not null
+	ResumePoint* resume = nullptr;    // continues the walk after the checkpoint (tar /u), if not null
+};
+
+void WriteEnd(ITarWriter* writer, char end, const TarOptions& options);
+
+// the open directories of the checkpoint from level k which are not listed anymore are ended
+void EndMissing(ITarWriter* writer, const TarOptions& options, size_t k)
+{
+	ResumePoint& resume = *options.resume;
+	if (k >= resume.dirs.size() || resume.found[k])
+		return;
+	for (size_t i = k; i < resume.dirs.size(); ++i) {
+		WriteEnd(writer, EndDir, options);
+		resume.found[i] = resume.entered[i] = true;
+	}
+}
+
+// the order of names in NTFS directories: compared in upper case
+int CompareNames(wstring_view a, wstring_view b)
+{
+	for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+		wint_t ca = towupper(a[i]), cb = towupper(b[i]);
+		if (ca != cb)
+			return ca < cb ? -1 : 1;
+	}
+	return a.size() == b.size() ? 0 : a.size() < b.size() ? -1 : 1;
+}
+
+// the item is not written: its name matches exclude masks, or it is before the checkpoint in the listing order
+// (written then, or appeared later where the walk has passed already)
+bool Excluded(const DirItem& it, const TarOptions& options, const filesystem::path& rel_path)
+{
+	if (mask_match(it.filename().data(), options.exclude)) // names are zero-terminated
+		return true;
+	int k = options.resume ? options.resume->Level(rel_path) : -1;
+	if (k < 0)
+		return false;
+	ResumePoint& resume = *options.resume;
+	wstring name(it.filename());
+	if (resume.done[k].count(name))
+		return true;
+	if (k < (int)resume.dirs.size() && !resume.found[k] && it.parent != DirItem::NoParent) { // items of the command line keep their order
+		wstring open = filesystem::path(resume.dirs[k]).filename().wstring();
+		int order = CompareNames(name, open);
+		return order < 0 || (order == 0 && (it.type != DirItem::Dir || name != open));
+	}
+	return false;
+}
+
+// Excluded item is skipped, the listing of skipped directory is dropped from the lister
+bool Skipped(const DirItem& it, const TarOptions& options, const filesystem::path& rel_path)
+{
+	if (!Excluded(it, options, rel_path))
+		return false;
+	if (it.type == DirItem::Dir && options.lister)
+		options.lister->Drop(it);
+	return true;
+}
+
+// the walk after the checkpoint reaches the item which is not Excluded: it is the open directory
+// or the first item after it, then the open directory is not listed anymore
+void ResumeAt(ITarWriter* writer, const DirItem& it, const TarOptions& options, const filesystem::path& rel_path)
+{
+	int k = options.resume ? options.resume->Level(rel_path) : -1;
+	if (k < 0 || k >= (int)options.resume->dirs.size() || options.resume->found[k])
+		return;
+	if (it.type == DirItem::Dir && filesystem::path(options.resume->dirs[k]).filename() == it.filename())
+		options.resume->found[k] = true;
+	else
+		EndMissing(writer, options, k);
+}
+
+void WriteTarDirectory(ITarWriter* writer, const DirItem& item, const TarOptions& options, const filesystem::path& rel_path, const wstring& prefix);
+void WriteTarFile(ITarWriter* writer, const DirItem& item, const TarOptions& options, const filesystem::path& rel_path, const wstring& prefix,
+	const vector<BYTE>* data = nullptr, const FileId* link = nullptr);
+void WriteTarStream(ITarWriter* writer, const DirItem& item, const TarOptions& options, const filesystem::path& rel_path, const wstring& prefix);
+
+void TarFilesOrdered(ITarWriter* writer, Coro::generator<DirItem>&& items, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix);
+void TarFilesPrefetch(ITarWriter* writer, Coro::generator<DirItem>&& items, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix);
+
+// data - contents of the file if it is already read, link - its id if it has several names (hard links)
+void WriteTarItem(ITarWriter* writer, const DirItem& it, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix, const vector<BYTE>* data = nullptr, const FileId* link = nullptr)
+{
+	if (options.resume) // at the time of writing: items taken ahead are written before
+		ResumeAt(writer, it, options, rel_path);
+	switch (it.type)
+	{
+	case DirItem::Dir:
+		WriteTarDirectory(writer, it, options, rel_path, prefix);
+		break;
+	case DirItem::File:
+		WriteTarFile(writer, it, options, rel_path, prefix, data, link);
+		break;
+	case DirItem::Stream:
+		WriteTarStream(writer, it, options, rel_path, prefix);
+		break;
+	case DirItem::Invalid: {
+		// if filename is given in command line and does not exist or just deleted after being listed
+		ConsoleColor cc(FOREGROUND_RED);
+		wcout << prefix << L"* " << it.name << L"  *** not found *** " << endl;
+	}
+						 break;
+	}
+	if (options.checkpoint && options.index->InDirectory())
+		options.checkpoint->Check();
+}
+
+void TarFiles(ITarWriter* writer, Coro::generator<DirItem>&& items, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix)
+{
+	if (options.prefetcher)
+		return TarFilesPrefetch(writer, move(items), options, rel_path, prefix);
+	if (options.physical_order)
+		return TarFilesOrdered(writer, move(items), options, rel_path, prefix);
+
+	for (auto& it : items)
+	{
+		if (Skipped(it, options, rel_path))
+			continue;
+		WriteTarItem(writer, it, options, rel_path, prefix);
+	}
+}
+
+// Items are taken by windows, small files of a window are read into memory in the order of their data on disk
+// (less seeks on HDD and fragmented volumes), then all items are written in the listing order.
+void TarFilesOrdered(ITarWriter* writer, Coro::generator<DirItem>&& items, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix)
+{
+	const size_t Window = 256;                      // items taken at once
+	const ULONGLONG MaxFile = 1024 * 1024;          // bigger files are read in place, seek is small part of their time
+
+	struct Pending
+	{
+		DirItem item;
+		wstring name;       // item.name points here
+		vector<BYTE> data;
+		bool read = false;  // data is prefetched
+		bool counted = false; // the file is open for prefetching, its size is in options.prefetched
+		bool linked = false; // the file has several names, link is its id
+		FileId link;
+	};
+	vector<Pending> window;
+	window.reserve(Window); // names must not move
+
+	auto flush = [&] {
+		vector<tuple<bool, ULONGLONG, size_t>> order; // files with known offset go after the others (MFT, inodes)
+		vector<unique_ptr<FileSimple>> files(window.size());
+		wstring path;
+		for (size_t i = 0; i < window.size(); ++i) {
+			const DirItem& item = window[i].item;
+			if (item.type != DirItem::File || item.size > MaxFile || options.prefetched + item.size > options.max_prefetched ||
+				(options.base && !options.base->WrittenWhole(item, rel_path / item.filename())))
+				continue;
+			options.paths->FullPath(item, path);
+			if (writer->IsMyFile(path, false))
+				continue;
+			auto fs = make_unique<FileSimple>(path.c_str());
+			if (!fs->IsOpen())
+				continue; // will be reported in WriteTarFile
+			ULONGLONG offset;
+			bool on_disk = physical_offset(fs->Handle(), offset);
+			order.emplace_back(on_disk, offset, i);
+			window[i].linked = hard_link_id(fs->Handle(), window[i].link);
+			files[i] = move(fs);
+			window[i].counted = true;
+			options.prefetched += item.size;
+		}
+		sort(order.begin(), order.end());
+		for (auto& [on_disk, offset, i] : order) {
+			Pending& p = window[i];
+			p.data.resize((size_t)p.item.size);
+			p.read = files[i]->Read(p.data.data(), (DWORD)p.data.size()) == p.data.size(); // if not, WriteTarFile reports
+			files[i].reset();
+		}
+		for (auto& p : window) {
+			WriteTarItem(writer, p.item, options, rel_path, prefix, p.read ? &p.data : nullptr, p.read && p.linked ? &p.link : nullptr);
+			if (p.counted) // read or not
+				options.prefetched -= p.item.size;
+			p.data = {};
+		}
+		window.clear();
+	};
+
+	for (auto& it : items)
+	{
+		if (Skipped(it, options, rel_path))
+			continue;
+		Pending& p = window.emplace_back(Pending{ it, wstring(it.name) });
+		p.item.name = p.name;
+		if (window.size() == Window)
+			flush();
+	}
+	flush();
+}
+
+// Files are scheduled to the prefetcher when listed and written when the queue of items is full,
+// so several files ahead are being opened and read while the current one is written.
+void TarFilesPrefetch(ITarWriter* writer, Coro::generator<DirItem>&& items, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix)
+{
+	const size_t Lookahead = 256; // items taken ahead, files are limited by prefetcher
+
+	struct Pending
+	{
+		DirItem item;
+		wstring name; // item.name points here, deque does not move elements
+		Prefetcher::FilePtr file;
+	};
+	deque<Pending> queue;
+	Prefetcher& prefetcher = *options.prefetcher;
+
+	auto write_front = [&] {
+		Pending& p = queue.front();
+		const vector<BYTE>* data = nullptr;
+		const FileId* link = nullptr;
+		if (p.file) {
+			prefetcher.Wait(*p.file);
+			if (p.file->ok)
+				data = &p.file->data;
+			if (p.file->linked)
+				link = &p.file->link;
+		}
+		WriteTarItem(writer, p.item, options, rel_path, prefix, data, link);
+		if (p.file)
+			prefetcher.Release(p.file);
+		queue.pop_front();
+	};
+
+	wstring path;
+	for (auto& it : items)
+	{
+		if (Skipped(it, options, rel_path))
+			continue;
+		Pending& p = queue.emplace_back(Pending{ it, wstring(it.name) });
+		p.item.name = p.name;
+		if (p.item.type == DirItem::File && !(options.base && !options.base->WrittenWhole(p.item, rel_path / p.item.filename()))) {
+			options.paths->FullPath(p.item, path);
+			if (!writer->IsMyFile(path, false))
+				p.file = prefetcher.Schedule(path, p.item.size);
+		}
+		if (queue.size() >= Lookahead)
+			write_front();
+	}
+	while (!queue.empty())
+		write_front();
+}
+
+// link - BeginLink: path in tar-file of the first name of the same file
+void WriteHeader(ITarWriter* writer, char type, const DirItem& di, const string& name_utf8, const TarOptions& options,
+	const string* link = nullptr)
+{
+	if (options.index)
+		options.index->BeginItem(type, di, name_utf8, options.headers ? options.headers->TimeBase() : 0);
+	writer->Write(type);
+	if (options.headers)
+		options.headers->Write(writer, type, di, name_utf8);
+	else {
+		if (HasSize(type))
+			writer->Write(di.size);
+		if (HasFileInfo(type)) {
+			writer->Write(di.dwFileAttributes);
+			writer->Write(di.ftLastWriteTime);
+		}
+		WORD wlen = (WORD)name_utf8.size();
+		writer->Write(wlen);
+		writer->Write(name_utf8.c_str(), wlen);
+	}
+	if (link) {
+		WORD wlen = (WORD)link->size();
+		writer->Write(wlen);
+		writer->Write(link->c_str(), wlen);
+	}
+}
+
+// type - BeginLink, UnchangedFile or DeltaFile instead of the type of item
+void WriteDirItem(ITarWriter* writer, const DirItem& di, const TarOptions& options, char type = 0, const string* link = nullptr)
+{
+	if (di.type == DirItem::Invalid)
+		return;
+	if (!type)
+		type = di.type == DirItem::Dir ? BeginDir : di.type == DirItem::File ? BeginFile : BeginStream;
+	WriteHeader(writer, type, di, ToChar(di.filename(), CP_UTF8), options, link);
+}
+
+void WriteEnd(ITarWriter* writer, char end, const TarOptions& options)
+{
+	writer->Write(end);
+	if (options.index)
+		options.index->EndItem();
+	if (options.headers)
+		options.headers->End();
+}
+
+// files which are compressed already, and files which are compressed well: the probe is not needed
+const wchar_t* const IncompressibleExtensions[] = {
+	L"7z", L"aac", L"apk", L"avi", L"bz2", L"cab", L"docx", L"flac", L"gif", L"gz", L"heic", L"jar", L"jpeg", L"jpg",
+	L"m4a", L"m4v", L"mkv", L"mov", L"mp3", L"mp4", L"ogg", L"opus", L"png", L"pptx", L"rar", L"star", L"tgz",
+	L"webm", L"webp", L"wmv", L"xlsx", L"xz", L"zip", L"zst",
+};
+const wchar_t* const CompressibleExtensions[] = {
+	L"c", L"cpp", L"cs", L"css", L"csv", L"h", L"hpp", L"htm", L"html", L"ini", L"java", L"js", L"json",
+	L"log", L"md", L"py", L"sql", L"txt", L"xml", L"yml",
+};
+
+// order-0 entropy of samples of data, bits per byte
+double SampledEntropy(const BYTE* data, size_t size)
+{
+	const size_t Samples = 16;
+	const size_t SampleSize = 128;
+	// 4 histograms: neighbouring bytes do not wait for the increment of the same counter
+	uint32_t hist[4][256] = {};
+	size_t count = 0;
+	size_t step = size / Samples;
+	for (size_t k = 0; k < Samples; ++k) {
+		const BYTE* p = data + k * step;
+		for (size_t i = 0; i < SampleSize; i += 4) {
+			++hist[0][p[i]];
+			++hist[1][p[i + 1]];
+			++hist[2][p[i + 2]];
+			++hist[3][p[i + 3]];
+		}
+		count += SampleSize;
+	}
+	double entropy = 0;
+	for (int b = 0; b < 256; ++b) {
+		if (uint32_t n = hist[0][b] + hist[1][b] + hist[2][b] + hist[3][b]) {
+			double p = double(n) / count;
+			entropy -= p * log2(p);
+		}
+	}
+	return entropy;
+}
+
+// data of the item goes to the compression stage as is or marked as incompressible,
+// first - the first block of data
+void BeginData(ITarWriter* writer, const DirItem& item, const BYTE* first, size_t size, const TarOptions& options)
+{
+	writer->DataBoundary();
+	if (!options.compress)
+		return;
+	if (item.type == DirItem::File) {
+		PathView name = item.filename();
+		size_t dot = name.rfind(L'.');
+		if (dot != PathView::npos) {
+			const wchar_t* ext = name.data() + dot + 1; // names are zero-terminated
+			for (auto e : IncompressibleExtensions) {
+				if (_wcsicmp(ext, e) == 0)
+					return writer->Incompressible(true);
+			}
+			for (auto e : CompressibleExtensions) {
+				if (_wcsicmp(ext, e) == 0)
+					return;
+			}
+		}
+	}
+	// random data gives about 7.8 with these samples, text and code 4 - 6
+	if (size >= 16 * 128 && SampledEntropy(first, size) > 7.5)
+		writer->Incompressible(true);
+}
+
+void EndData(ITarWriter* writer, const TarOptions& options)
+{
+	writer->DataBoundary();
+	if (options.compress)
+		writer->Incompressible(false);
+}
+
+// block signatures of the file are kept in the index (tar /b)
+bool KeepsSums(const DirItem& item, const TarOptions& options)
+{
+	return options.sums && options.index && item.type == DirItem::File && item.size >= DeltaMinSize;
+}
+
+void WriteData(ITarWriter* writer, FileSimple& fs, const DirItem& item, const wchar_t* src, const TarOptions& options)
+{
+	optional<BlockSummer> summer;
+	if (KeepsSums(item, options))
+		summer.emplace();
+	ULONGLONG total = item.size;
+	bool first = true;
+	while (total != 0)
+	{
+		BYTE buf[64 * 1024];
+		SetLastError(0);
+		ULONGLONG to_read = sizeof(buf);
+		if (to_read > total)
+			to_read = total;
+		DWORD dwBytesRead = fs.Read(buf, (DWORD)to_read);
+		if (dwBytesRead != (DWORD)to_read)
+			throw MyException{ L"Failed to read '<path>': <err>", src, GetLastError() };
+		if (first)
+			BeginData(writer, item, buf, dwBytesRead, options);
+		first = false;
+		writer->Write(buf, dwBytesRead);
+		if (summer)
+			summer->Add(buf, dwBytesRead);
+		total -= to_read;
+	}
+	EndData(writer, options);
+	if (summer)
+		options.index->AddSums(summer->Finish());
+}
+
+// Data of DeltaFile: size and last write time of the file in the base, then operations until DeltaEnd:
+// DeltaCopy, LEB128 number of the first block of the base version and LEB128 count of blocks (DeltaBlock each);
+// DeltaData, LEB128 size and the bytes. The window of DeltaBlock bytes moves over the file, its rolling sum
+// is looked up among the whole blocks of the base version and SHA-1 confirms the match.
+const BYTE DeltaEnd = 0;
+const BYTE DeltaCopy = 1;
+const BYTE DeltaData = 2;
+
+void WriteDelta(ITarWriter* writer, FileSimple& fs, const DirItem& item, const wchar_t* src,
+	const vector<BlockSum>& base, ULONGLONG base_size, FILETIME base_time, const TarOptions& options)
+{
+	// whole blocks of the base version by weak sums, the filter rejects most of positions at once
+	const int FilterBits = 20;
+	vector<pair<uint32_t, DWORD>> blocks;
+	vector<bool> filter(size_t(1) << FilterBits);
+	for (DWORD i = 0; i < base.size() && ULONGLONG(i + 1) * DeltaBlock <= base_size; ++i) {
+		blocks.push_back({ base[i].weak, i });
+		filter[base[i].weak >> (32 - FilterBits)] = true;
+	}
+	sort(blocks.begin(), blocks.end());
+
+	optional<BlockSummer> summer;
+	if (KeepsSums(item, options))
+		summer.emplace();
+	vector<BYTE> buf(4 * DeltaBlock);
+	size_t filled = 0;      // bytes in buf
+	size_t pos = 0;         // of the window
+	size_t literal = 0;     // the first byte not written yet
+	ULONGLONG rest = item.size; // not read yet
+	ULONGLONG copy_first = 0, copy_count = 0; // blocks to copy are joined while they follow each other
+	RollingSum sum;
+	bool rolling = false;   // sum is valid for the window
+
+	auto write_copy = [&] {
+		if (!copy_count)
+			return;
+		writer->Write(DeltaCopy);
+		WriteVarint(writer, copy_first);
+		WriteVarint(writer, copy_count);
+		options.delta += copy_count * DeltaBlock;
+		copy_count = 0;
+	};
+	auto write_literal = [&] {
+		if (pos > literal) {
+			write_copy();
+			writer->Write(DeltaData);
+			WriteVarint(writer, pos - literal);
+			writer->Write(buf.data() + literal, DWORD(pos - literal));
+		}
+		literal = pos;
+	};
+
+	writer->Write(base_size);
+	writer->Write(base_time);
+	for (;;) {
+		if (pos + DeltaBlock >= filled && rest) { // the window and the next byte for rolling
+			write_literal();
+			memmove(buf.data(), buf.data() + pos, filled - pos);
+			filled -= pos;
+			pos = literal = 0;
+			DWORD part = (DWORD)min<ULONGLONG>(rest, buf.size() - filled);
+			SetLastError(0);
+			if (fs.Read(buf.data() + filled, part) != part)
+				throw MyException{ L"Failed to read '<path>': <err>", src, GetLastError() };
+			if (rest == item.size)
+				BeginData(writer, item, buf.data(), part, options);
+			if (summer)
+				summer->Add(buf.data() + filled, part);
+			filled += part;
+			rest -= part;
+			continue;
+		}
+		if (pos + DeltaBlock > filled)
+			break; // the tail is shorter than a block
+		if (!rolling) {
+			sum.Init(buf.data() + pos, DeltaBlock);
+			rolling = true;
+		}
+		uint32_t weak = sum.Value();
+		bool found = false;
+		DWORD match = 0;
+		if (filter[weak >> (32 - FilterBits)]) {
+			auto it = lower_bound(blocks.begin(), blocks.end(), make_pair(weak, DWORD(0)));
+			optional<array<uint8_t, 20>> strong;
+			for (; it != blocks.end() && it->first == weak; ++it) {
+				if (!strong)
+					strong = sha1_digest(buf.data() + pos, DeltaBlock);
+				if (memcmp(strong->data(), base[it->second].strong, sizeof(BlockSum::strong)) != 0)
+					continue;
+				if (!found || it->second == copy_first + copy_count) { // the block following the previous copy is preferred
+					match = it->second;
+					found = true;
+				}
+			}
+		}
+		if (found) {
+			write_literal();
+			if (!copy_count || match != copy_first + copy_count) {
+				write_copy();
+				copy_first = match;
+			}
+			++copy_count;
+			pos += DeltaBlock;
+			literal = pos;
+			rolling = false;
+		}
+		else {
+			if (pos + DeltaBlock < filled)
+				sum.Roll(buf[pos], buf[pos + DeltaBlock], DeltaBlock);
+			else
+				rolling = false;
+			++pos;
+		}
+	}
+	if (item.size == 0)
+		BeginData(writer, item, buf.data(), 0, options);
+	pos = filled;
+	write_literal();
+	write_copy();
+	writer->Write(DeltaEnd);
+	EndData(writer, options);
+	if (summer)
+		options.index->AddSums(summer->Finish());
+}
+
+void PrintFileData(DirItem::Type type, wstring_view name, ULONGLONG size, wstring_view prefix)
+{
+	WORD wColor =
+		type == DirItem::Stream ? FOREGROUND_GREEN | FOREGROUND_BLUE :
+		type == DirItem::Dir ? FOREGROUND_RED | FOREGROUND_GREEN :
+		FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+	ConsoleColor cc(wColor);
+	auto sign = type == DirItem::Dir ? L"> " : L"+ ";
+	wcout << prefix << sign << name;
+	if (type != DirItem::Dir)
+		wcout << L"   " << size;
+	wcout << endl;
+}
+
+void PrintFileData(const DirItem& item, const filesystem::path& rel_path, const wstring& prefix)
+{
+	//wcout << prefix << L"+ " << item.name.c_str() << endl;
+	//wcout << prefix << L"+ " << (rel_path / item.name.filename()).c_str() << endl;
+	PrintFileData(item.type, item.filename(), item.size, prefix);
+}
+
+void PrintDeleted(wstring_view name, wstring_view prefix)
+{
+	ConsoleColor cc(FOREGROUND_RED | FOREGROUND_BLUE);
+	wcout << prefix << L"- " << name << endl;
+}
+
+// markers of the items of the base directory which are not found
+void WriteDeleted(ITarWriter* writer, DWORD base_dir, const TarOptions& options, const wstring& prefix)
+{
+	wstring name;
+	for (auto& name_utf8 : options.base->Deleted(base_dir)) {
+		WriteHeader(writer, DeletedItem, DirItem{}, name_utf8, options);
+		++options.deleted;
+		if (!options.estimate) {
+			ToWideChar(name_utf8, CP_UTF8, name);
+			PrintDeleted(name, prefix);
+		}
+	}
+}
+
+void WriteTarDirectory(ITarWriter* writer, const DirItem& item, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix)
+{
+	if (!options.estimate)
+		PrintFileData(item, rel_path, prefix);
+	// the directory which was open at the checkpoint: its header and items before are written
+	int level = options.resume ? options.resume->Level(rel_path) : -1;
+	bool resumed = level >= 0 && level < (int)options.resume->dirs.size() && !options.resume->entered[level] &&
+		rel_path / item.filename() == options.resume->dirs[level];
+	if (resumed)
+		options.resume->entered[level] = true;
+	else
+		WriteDirItem(writer, item, options);
+	DWORD base_dir = options.base ? options.base->Find(rel_path / item.filename()) : IndexNoParent;
+	uint32_t dir = DirItem::NoParent;
+	if (!options.lister)
+		dir = options.paths->Add(item);
+	//	TarFiles(writer, directory_items(*options.paths, dir), options, rel_path / item.filename(), prefix + L"  ");
+	TarFiles(writer, options.lister ? options.lister->get_files(item, dir) : get_files(*options.paths, dir),
+		options, rel_path / item.filename(), prefix + L"  ");
+	options.paths->Release(dir); // the items are written, their paths are not needed any more
+	if (resumed)
+		EndMissing(writer, options, level + 1);
+	if (base_dir != IndexNoParent)
+		WriteDeleted(writer, base_dir, options, prefix + L"  ");
+	//wcout << L"end " << item.c_str() << endl;
+	WriteEnd(writer, EndDir, options);
+}
+
+
+void WriteTarFile(ITarWriter* writer, const DirItem& item, const TarOptions& options, const filesystem::path& rel_path, const wstring& prefix,
+	const vector<BYTE>* data, const FileId* link)
+{
+	wstring path;
+	options.paths->FullPath(item, path);
+	if (writer->IsMyFile(path, false)) // do not add tar itself to the tar
+		return;
+
+	ULONGLONG base_size;
+	if (options.base && options.base->Unchanged(item, rel_path / item.filename())) {
+		WriteDirItem(writer, item, options, UnchangedFile);
+		if (options.sums && options.index) // for the next increment
+			if (auto sums = options.base->Sums(rel_path / item.filename(), base_size))
+				options.index->AddSums(*sums);
+		++options.unchanged;
+		return;
+	}
+
+	if (options.estimate) {
+		WriteDirItem(writer, item, options);
+		writer->Count(item.size);
+		TarFiles(writer, get_streams(*options.paths, item), options, rel_path, prefix);
+		WriteEnd(writer, EndFile, options);
+		return;
+	}
+
+	PrintFileData(item, rel_path, prefix);
+
+	FileSimple fs(data ? nullptr : path.c_str());
+	if (!data && !fs.IsOpen())
+	{
+		ConsoleColor cc(FOREGROUND_RED);
+		wcout << prefix << L"* " << path << L"  *** failed to open *** " << endl;
+		return;
+	}
+	// the file with several names is stored once, its other names are links to the first one
+	FileId id;
+	if (data ? link != nullptr : hard_link_id(fs.Handle(), id)) {
+		auto [first, added] = options.links.try_emplace(link ? *link : id, ToChar((rel_path / item.filename()).wstring(), CP_UTF8));
+		if (!added) {
+			WriteDirItem(writer, item, options, BeginLink, &first->second);
+			return;
+		}
+		if (options.checkpoint)
+			options.links_added.push_back(first->first);
+	}
+	// changed big file: only its blocks which differ from the base version
+	FILETIME base_time;
+	const vector<BlockSum>* base_sums = options.base && !data ?
+		options.base->Sums(rel_path / item.filename(), base_size, &base_time) : nullptr;
+	WriteDirItem(writer, item, options, base_sums ? DeltaFile : 0);
+	if (base_sums)
+		WriteDelta(writer, fs, item, path.c_str(), *base_sums, base_size, base_time, options);
+	else if (data) {
+		BeginData(writer, item, data->data(), data->size(), options);
+		writer->Write(data->data(), (DWORD)data->size());
+		EndData(writer, options);
+		if (KeepsSums(item, options)) {
+			BlockSummer summer;
+			summer.Add(data->data(), data->size());
+			options.index->AddSums(summer.Finish());
+		}
+	}
+	else
+		WriteData(writer, fs, item, path.c_str(), options);
+	//	write streams
+	TarFiles(writer, get_streams(*options.paths, item), options, rel_path, prefix);
+	WriteEnd(writer, EndFile, options);
+}
+
+void CorrectDirStreamName(wstring& fn)
+{
+	// directory name "dir\\:stream" -> "dir:stream"
+	// but ".\\:stream" is ok and -> ".:stream" is invalid
+	// ex1\..\:dirstr.tx3 is valid
+	// ex1\..:dirstr.tx4 is invalid
+	auto ix = fn.find(L"\\:");
+	if (ix != wstring::npos && !(ix > 0 && fn[ix - 1] == '.')) // ".\\:" is ok, "\\:" must be replaced
+		fn.erase(ix, 1);
+}
+
+void WriteTarStream(ITarWriter* writer, const DirItem& item, const TarOptions& options, const filesystem::path& rel_path, const wstring& prefix)
+{
+	wstring fn;
+	options.paths->FullPath(item, fn);
+	if (writer->IsMyFile(fn, true)) // do not add tar itself to the tar
+		return;
+
+	if (options.estimate) {
+		WriteDirItem(writer, item, options);
+		writer->Count(item.size);
+		return;
+	}
+
+	PrintFileData(item, rel_path, prefix);
+
+	CorrectDirStreamName(fn);
+	FileSimple fs(fn.c_str());
+	if (!fs.IsOpen())
+	{
+		ConsoleColor cc(FOREGROUND_RED);
+		wcout << prefix << L"* " << fn << L"  *** failed to open *** " << endl;
+		return;
+	}
+	WriteDirItem(writer, item, options);
+	WriteData(writer, fs, item, fn.c_str(), options);
+}
+
+// size of tar-file with 'size' bytes of tar data encrypted with 'layers' passwords (see writers chain in Tar)
+ULONGLONG EncryptedSize(ULONGLONG size, size_t layers)
+{
+	auto round_up = [](ULONGLONG n, ULONGLONG block) { return (n + block - 1) / block * block; };
+	for (size_t i = 0; i < layers; ++i) {
+		if (i & 1)
+			size = round_up(size, 32); // TarWriterShaker
+		else
+			size = round_up(size, 16) + (i == 0 ? 16 : 0); // TarWriterAES, the first one writes IV
+	}
+	return size;
 }
 
 array<uint8_t, 16> digest_to_key(const array<uint8_t, 20>& digest)
@@ -593,6 +1981,1046 @@ array<uint8_t, 16> digest_to_key(const array<uint8_t, 20>& digest)
 	return key;
 }
 
+vector<array<uint8_t, 20>> PasswordDigests(const vector<wstring>& pw)
+{
+	vector<array<uint8_t, 20>> digests;
+	for (auto& p : pw) {
+		string utf8 = ToChar(p, CP_UTF8);
+		digests.push_back(sha1_digest(utf8.data(), (unsigned int)utf8.size()));
+	}
+	return digests;
+}
+
+// chain of ciphers, one per password: AES and Shaker alternate;
+// ivs - CBC state of AES layers (others are ignored), write_iv - the first AES writes its iv (new tar-file)
+unique_ptr<ITarWriter> CipherWriter(unique_ptr<ITarWriter>&& dst, const vector<array<uint8_t, 20>>& digests,
+	const vector<array<uint8_t, 16>>& ivs, bool write_iv)
+{
+	unique_ptr<ITarWriter> writer = move(dst);
+	for (int i = (int)digests.size() - 1; i >= 0; --i) {
+		unique_ptr<ITarWriter> next = move(writer);
+		if (i & 1)
+			writer = unique_ptr<ITarWriter>(new TarWriterShaker(move(next), digests[i].data()));
+		else {
+			array<uint8_t, 16> key = digest_to_key(digests[i]);
+			writer = unique_ptr<ITarWriter>(new TarWriterAES(move(next), key.data(), ivs[i].data(), i == 0 && write_iv));
+		}
+	}
+	return writer;
+}
+
+// the first AES writes iv, the other ones start with zero iv
+unique_ptr<ITarWriter> CipherWriter(unique_ptr<ITarWriter>&& dst, const vector<array<uint8_t, 20>>& digests, const array<uint8_t, 16>& iv)
+{
+	vector<array<uint8_t, 16>> ivs(digests.size());
+	if (!ivs.empty())
+		ivs[0] = iv;
+	return CipherWriter(move(dst), digests, ivs, true);
+}
+
+// first - the innermost layer to decrypt, the layers before it are left (their output is read)
+unique_ptr<ITarReader> CipherReader(unique_ptr<ITarReader>&& src, const vector<array<uint8_t, 20>>& digests, size_t first = 0)
+{
+	unique_ptr<ITarReader> reader = move(src);
+	for (int i = (int)digests.size() - 1; i >= (int)first; --i) {
+		unique_ptr<ITarReader> next = move(reader);
+		if (i & 1)
+			reader = unique_ptr<ITarReader>(new TarReaderShaker(move(next), digests[i].data()));
+		else {
+			array<uint8_t, 16> key = digest_to_key(digests[i]);
+			reader = unique_ptr<ITarReader>(new TarReaderAES(move(next), key.data(), i == 0));
+		}
+	}
+	return reader;
+}
+
+class TarWriterMemory : public ITarWriter
+{
+public:
+	TarWriterMemory(vector<BYTE>& dst) : dst(dst) {}
+	virtual void Write(const void* buf, DWORD size) override
+	{
+		dst.insert(dst.end(), (const BYTE*)buf, (const BYTE*)buf + size);
+	}
+protected:
+	vector<BYTE>& dst;
+};
+
+class TarReaderMemory : public ITarReader
+{
+public:
+	TarReaderMemory(const vector<BYTE>& src) : src(src) {}
+	virtual void Read(void* buf, DWORD size) override
+	{
+		if (size > src.size() - pos)
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		memcpy(buf, src.data() + pos, size);
+		pos += size;
+	}
+protected:
+	const vector<BYTE>& src;
+	size_t pos = 0;
+};
+
+const char CheckpointMagic[8] = { 'S', 'T', 'A', 'R', 'C', 'K', 'P', '1' };
+
+void Checkpoint::Save()
+{
+	if (journal)
+		AppendJournal();
+	filesystem::path temp = name;
+	temp += L".tmp";
+	{
+		TarWriterFiles* file = new TarWriterFiles(temp, 0);
+		unique_ptr<ITarWriter> writer(new TarWriterBuffer(unique_ptr<ITarWriter>(file)));
+		if (!pw.empty())
+			writer = CipherWriter(move(writer), PasswordDigests(pw), random_iv());
+		writer->Write(CheckpointMagic);
+		writer->Write(journal_size);
+		state(writer.get());
+		writer->Flush();
+		file->Sync();
+	}
+	if (!MoveFileEx(temp.c_str(), name.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		throw MyException{ L"Failed to write to '<path>': <err>", name.c_str(), GetLastError() };
+	next = steady_clock::now() + seconds(interval);
+}
+
+// a block of the journal: its size, then the data encrypted with its own iv;
+// blocks after journal_size (written before an interruption of the save) are overwritten
+void Checkpoint::AppendJournal()
+{
+	vector<BYTE> block;
+	{
+		unique_ptr<ITarWriter> writer(new TarWriterMemory(block));
+		if (!pw.empty())
+			writer = CipherWriter(move(writer), PasswordDigests(pw), random_iv());
+		journal(writer.get());
+		writer->Flush();
+	}
+	DWORD size = (DWORD)block.size();
+	FileSimple fs;
+	if (!fs.OpenRW(journal_name.c_str()))
+		throw MyException{ L"Failed to open '<path>': <err>", journal_name.c_str(), GetLastError() };
+	if (!fs.Seek((LONGLONG)journal_size, FILE_BEGIN) || fs.Write(&size, sizeof(size)) != sizeof(size) ||
+		(size && fs.Write(block.data(), size) != size) || !fs.SetEOF() || !FlushFileBuffers(fs.Handle()))
+		throw MyException{ L"Failed to write to '<path>': <err>", journal_name.c_str(), GetLastError() };
+	journal_size += sizeof(size) + size;
+}
+
+unique_ptr<ITarReader> Checkpoint::Load(FileSimple& fs, const function<void(ITarReader*)>& replay)
+{
+	if (!fs.Open(name.c_str(), false, true))
+		throw MyException{ L"Failed to open '<path>': <err>", name.c_str(), GetLastError() };
+	auto reader = CipherReader(unique_ptr<ITarReader>(new FileReader(fs, name.c_str())), PasswordDigests(pw));
+	char magic[sizeof(CheckpointMagic)];
+	reader->Read(magic);
+	if (memcmp(magic, CheckpointMagic, sizeof(magic)) != 0)
+		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+	reader->Read(journal_size);
+	if (journal_size && replay) {
+		FileSimple log;
+		if (!log.Open(journal_name.c_str(), false, true))
+			throw MyException{ L"Failed to open '<path>': <err>", journal_name.c_str(), GetLastError() };
+		FileReader file(log, journal_name.c_str());
+		vector<BYTE> block;
+		for (ULONGLONG pos = 0; pos < journal_size; ) {
+			DWORD size;
+			file.Read(&size, sizeof(size));
+			pos += sizeof(size) + size;
+			if (pos > journal_size)
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			block.resize(size);
+			file.Read(block.data(), size);
+			replay(CipherReader(unique_ptr<ITarReader>(new TarReaderMemory(block)), PasswordDigests(pw)).get());
+		}
+	}
+	return reader;
+}
+
+// Framed tar-file: FrameMagic, then frames of FrameSize bytes of tar data (the last one can be shorter),
+// each frame is encrypted separately with its own iv and is preceded by FrameHeader.
+// Frames are encrypted and decrypted in parallel, and the reader seeks over whole frames.
+const char FrameMagic[8] = { 'S', 'T', 'A', 'R', 'F', 'R', 'M', '1' };
+const DWORD FrameSize = 4 * 1024 * 1024;
+
+struct FrameHeader
+{
+	DWORD size;           // of tar data in the frame, not more than FrameSize
+	DWORD stored;         // encrypted size: EncryptedSize(size, passwords)
+};
+
+ULONGLONG FramedSize(ULONGLONG size, size_t layers)
+{
+	ULONGLONG frames = size / FrameSize;
+	ULONGLONG result = sizeof(FrameMagic) + frames * (sizeof(FrameHeader) + EncryptedSize(FrameSize, layers));
+	if (DWORD rest = DWORD(size % FrameSize))
+		result += sizeof(FrameHeader) + EncryptedSize(rest, layers);
+	return result;
+}
+
+// returns false if the tar-file is not framed
+bool FramedDataSize(FileSimple& fs, const wchar_t* tarname, ULONGLONG& size)
+{
+	char magic[sizeof(FrameMagic)];
+	if (!fs.Seek(0, FILE_BEGIN))
+		throw MyException{ L"Failed to read '<path>': <err>", tarname, GetLastError() };
+	if (fs.Read(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, FrameMagic, sizeof(magic)) != 0)
+		return false;
+	size = 0;
+	FrameHeader hdr;
+	while (DWORD got = fs.Read(&hdr, sizeof(hdr))) {
+		if (got != sizeof(hdr) || hdr.size > FrameSize || !fs.Seek(hdr.stored))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		size += hdr.size;
+	}
+	return true;
+}
+
+// replaces the cipher chain: collects frames of tar data and encrypts them on several threads
+class TarWriterFrames : public ITarWriter
+{
+public:
+	// a frame in work takes its data and encrypted data: the current one, pending ones and one more before writing;
+	// at least a frame for each thread is pending, a smaller budget is an error
+	TarWriterFrames(unique_ptr<ITarWriter>&& dst, vector<array<uint8_t, 20>> digests, unsigned threads)
+		: dst(move(dst)), digests(move(digests)), share((threads + 2) * 2 * FrameSize, (2 * threads + 2) * 2 * FrameSize),
+		max_pending(share.Size() / (2 * FrameSize) - 2), queue(threads)
+	{
+		this->dst->Write(FrameMagic, sizeof(FrameMagic));
+		current.reserve(FrameSize);
+	}
+	virtual void Write(const void* buf, DWORD size) override
+	{
+		const BYTE* ptr = (const BYTE*)buf;
+		while (size) {
+			DWORD part = min(size, DWORD(FrameSize - current.size()));
+			current.insert(current.end(), ptr, ptr + part);
+			ptr += part;
+			size -= part;
+			if (current.size() == FrameSize)
+				Submit();
+		}
+	}
+	virtual bool IsMyFile(const filesystem::path& path, bool is_stream) { return dst->IsMyFile(path, is_stream); }
+	virtual void Flush() override
+	{
+		if (!current.empty())
+			Submit();
+		while (!pending.empty())
+			WriteFront();
+		dst->Flush();
+	}
+protected:
+	struct Frame
+	{
+		vector<BYTE> data;
+		array<uint8_t, 16> iv;
+		vector<BYTE> stored;
+	};
+	void Submit()
+	{
+		auto frame = make_shared<Frame>();
+		frame->data = move(current);
+		current.clear();
+		current.reserve(FrameSize);
+		// random_iv() is seeded by time, the number of frame keeps ivs of frames different
+		frame->iv = random_iv();
+		for (int i = 0; i < 8; ++i)
+			frame->iv[i] ^= uint8_t(frames >> (i * 8));
+		++frames;
+		auto task = queue.Submit([this, frame] {
+			frame->stored.reserve((size_t)EncryptedSize(frame->data.size(), digests.size()));
+			unique_ptr<ITarWriter> writer = CipherWriter(unique_ptr<ITarWriter>(new TarWriterMemory(frame->stored)), digests, frame->iv);
+			writer->Write(frame->data.data(), (DWORD)frame->data.size());
+			writer->Flush();
+		});
+		pending.push_back({ frame, task });
+		while (pending.size() > max_pending)
+			WriteFront();
+	}
+	void WriteFront()
+	{
+		auto [frame, task] = move(pending.front());
+		pending.pop_front();
+		queue.Wait(task);
+		FrameHeader hdr = { (DWORD)frame->data.size(), (DWORD)frame->stored.size() };
+		dst->Write(hdr);
+		dst->Write(frame->stored.data(), hdr.stored);
+	}
+
+	unique_ptr<ITarWriter> dst;
+	const vector<array<uint8_t, 20>> digests;
+	MemoryBudget::Share share;
+	size_t max_pending;
+	vector<BYTE> current;
+	ULONGLONG frames = 0;
+	deque<pair<shared_ptr<Frame>, WorkQueue::TaskPtr>> pending; // in the order of writing
+	WorkQueue queue;      // the last: its threads use the members above
+};
+
+// reads frames ahead and decrypts them on several threads
+class TarReaderFrames : public ITarReader
+{
+public:
+	// fs is positioned after FrameMagic
+	// a frame in work takes its encrypted and decrypted data: pending ones and the one being read
+	TarReaderFrames(FileSimple& fs, const wchar_t* name, vector<array<uint8_t, 20>> digests, unsigned threads)
+		: fs(fs), name(name), digests(move(digests)), share((threads + 1) * 2 * FrameSize, (2 * threads + 1) * 2 * FrameSize),
+		max_pending(share.Size() / (2 * FrameSize) - 1), queue(threads)
+	{
+	}
+	virtual void Read(void* buf, DWORD size) override
+	{
+		uint8_t* ptr = (uint8_t*)buf;
+		while (size) {
+			DWORD in_buf = DWORD(data.size() - data_read);
+			if (in_buf >= size) {
+				memcpy(ptr, data.data() + data_read, size);
+				data_read += size;
+				break;
+			}
+			if (in_buf > 0) {
+				memcpy(ptr, data.data() + data_read, in_buf);
+				ptr += in_buf;
+				size -= in_buf;
+			}
+			NextFrame();
+		}
+	}
+	virtual void Skip(ULONGLONG size) override
+	{
+		DWORD in_buf = DWORD(data.size() - data_read);
+		if (in_buf >= size) {
+			data_read += (DWORD)size;
+			return;
+		}
+		size -= in_buf;
+		data.clear();
+		data_read = 0;
+		// whole frames are dropped if they are read already or seeked over
+		while (!pending.empty() && pending.front().first->size <= size) {
+			size -= pending.front().first->size;
+			pending.pop_front();
+		}
+		if (pending.empty()) {
+			FrameHeader hdr;
+			while (ReadHeader(hdr)) {
+				if (hdr.size > size) {
+					Submit(hdr);
+					break;
+				}
+				if (!fs.Seek(hdr.stored))
+					throw MyException{ L"Failed to read '<path>': <err>", name, GetLastError() };
+				size -= hdr.size;
+			}
+		}
+		if (size) {
+			NextFrame();
+			data_read = (DWORD)size;
+		}
+	}
+protected:
+	struct Frame
+	{
+		DWORD size;
+		vector<BYTE> stored;
+		vector<BYTE> data;
+	};
+	bool ReadHeader(FrameHeader& hdr)
+	{
+		if (end_of_file)
+			return false;
+		DWORD got = fs.Read(&hdr, sizeof(hdr));
+		if (got == 0)
+			return !(end_of_file = true);
+		if (got != sizeof(hdr) || hdr.size == 0 || hdr.size > FrameSize || hdr.stored != EncryptedSize(hdr.size, digests.size()))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		return true;
+	}
+	void Submit(const FrameHeader& hdr)
+	{
+		auto frame = make_shared<Frame>();
+		frame->size = hdr.size;
+		frame->stored.resize(hdr.stored);
+		if (fs.Read(frame->stored.data(), hdr.stored) != hdr.stored)
+			throw MyException{ L"Failed to read '<path>': <err>", name, GetLastError() };
+		auto task = queue.Submit([this, frame] {
+			frame->data.resize(frame->size);
+			unique_ptr<ITarReader> reader = CipherReader(unique_ptr<ITarReader>(new TarReaderMemory(frame->stored)), digests);
+			reader->Read(frame->data.data(), frame->size);
+		});
+		pending.push_back({ frame, task });
+	}
+	void NextFrame()
+	{
+		FrameHeader hdr;
+		while (pending.size() < max_pending && ReadHeader(hdr))
+			Submit(hdr);
+		if (pending.empty())
+			throw MyException{ L"Failed to read '<path>': <err>", name, ERROR_HANDLE_EOF };
+		auto [frame, task] = move(pending.front());
+		pending.pop_front();
+		queue.Wait(task);
+		data = move(frame->data);
+		data_read = 0;
+	}
+
+	FileSimple& fs;
+	const wchar_t* name;
+	const vector<array<uint8_t, 20>> digests;
+	MemoryBudget::Share share;
+	size_t max_pending;
+	bool end_of_file = false;
+	vector<BYTE> data;    // decrypted frame
+	DWORD data_read = 0;  // consumed bytes
+	deque<pair<shared_ptr<Frame>, WorkQueue::TaskPtr>> pending; // in the order of reading
+	WorkQueue queue;      // the last: its threads use the members above
+};
+
+// Compressed and deduplicated data end with the size of the data given to the stage, so the index is found
+// without reading the stage: the footer is the last 8 bytes, it is preceded by zeros to make the stage output
+// a multiple of 32 bytes (its size is known from the size of tar-file as the size of plain tar data, see TarIndex).
+void WriteStageFooter(ITarWriter* dst, ULONGLONG position, ULONGLONG data_size)
+{
+	const uint8_t zeros[32] = {};
+	dst->Write(zeros, DWORD((64 - (position + sizeof(data_size)) % 32) % 32));
+	dst->Write(data_size);
+}
+
+// position - in src, stage_size - of the whole stage output in src
+ULONGLONG ReadStageFooter(ITarReader* src, ULONGLONG position, ULONGLONG stage_size)
+{
+	ULONGLONG data_size;
+	if (stage_size < position + sizeof(data_size) || stage_size % 32 != 0)
+		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+	src->Skip(stage_size - position - sizeof(data_size));
+	src->Read(data_size);
+	return data_size;
+}
+
+// Compressed tar data: CompressMagic, then blocks of BlockSize bytes of tar data (the last one can be shorter),
+// each block is compressed separately and is preceded by BlockHeader, the header with size 0 ends the data,
+// the footer follows (see WriteStageFooter). The stage is above the ciphers. Blocks are compressed and
+// decompressed in parallel, the reader seeks over whole blocks.
+const char CompressMagic[4] = { 'Z', 'S', 'T', '2' }; // 'Z' is not a type of item
+const DWORD BlockSize = 1024 * 1024;
+
+enum BlockCodec : BYTE { CodecStored, CodecLzFast, CodecLzHigh };
+
+struct BlockHeader
+{
+	DWORD size;           // of tar data in the block, not more than BlockSize
+	DWORD packed;         // size of compressed data, less than size (equal if stored)
+	BlockCodec codec;
+	BYTE reserved[3];
+};
+static_assert(sizeof(BlockHeader) == 12);
+
+class TarWriterCompress : public ITarWriter
+{
+public:
+	// a block in work takes its data and compressed data, as frames of TarWriterFrames
+	TarWriterCompress(unique_ptr<ITarWriter>&& dst, LzLevel level, unsigned threads)
+		: dst(move(dst)), level(level), share((threads + 2) * 2 * BlockSize, (2 * threads + 2) * 2 * BlockSize),
+		max_pending(share.Size() / (2 * BlockSize) - 2), queue(threads)
+	{
+		this->dst->Write(CompressMagic, sizeof(CompressMagic));
+		current.reserve(BlockSize);
+	}
+	virtual void Write(const void* buf, DWORD size) override
+	{
+		const BYTE* ptr = (const BYTE*)buf;
+		input += size;
+		while (size) {
+			DWORD part = min(size, DWORD(BlockSize - current.size()));
+			current.insert(current.end(), ptr, ptr + part);
+			if (incompressible)
+				incompressible_bytes += part;
+			ptr += part;
+			size -= part;
+			if (current.size() == BlockSize)
+				Submit();
+		}
+	}
+	virtual bool IsMyFile(const filesystem::path& path, bool is_stream) { return dst->IsMyFile(path, is_stream); }
+	virtual void Incompressible(bool on) override { incompressible = on; }
+	virtual void Flush() override
+	{
+		if (!current.empty())
+			Submit();
+		while (!pending.empty())
+			WriteFront();
+		BlockHeader end = {};
+		dst->Write(end);
+		WriteStageFooter(dst.get(), position + sizeof(end), input);
+		dst->Flush();
+	}
+protected:
+	struct Block
+	{
+		vector<BYTE> data;
+		vector<BYTE> packed;  // empty if data is stored
+		BlockCodec codec = CodecStored;
+	};
+	void Submit()
+	{
+		auto block = make_shared<Block>();
+		block->data = move(current);
+		current.clear();
+		current.reserve(BlockSize);
+		// mostly incompressible block is stored without trying
+		bool store = incompressible_bytes * 2 > block->data.size();
+		incompressible_bytes = 0;
+		if (store) {
+			pending.push_back({ block, nullptr });
+			return;
+		}
+		auto task = queue.Submit([this, block] {
+			// compressed data must be smaller, else the block is stored
+			block->packed.resize(block->data.size() - 1);
+			size_t size = block->data.size() > 1 ?
+				lz_compress(block->data.data(), block->data.size(), block->packed.data(), block->packed.size(), level) : 0;
+			block->packed.resize(size);
+			if (size)
+				block->codec = level == lz_fast ? CodecLzFast : CodecLzHigh;
+		});
+		pending.push_back({ block, task });
+		while (pending.size() > max_pending)
+			WriteFront();
+	}
+	void WriteFront()
+	{
+		auto [block, task] = move(pending.front());
+		pending.pop_front();
+		if (task)
+			queue.Wait(task);
+		const vector<BYTE>& out = block->codec == CodecStored ? block->data : block->packed;
+		BlockHeader hdr = { (DWORD)block->data.size(), (DWORD)out.size(), block->codec };
+		dst->Write(hdr);
+		dst->Write(out.data(), hdr.packed);
+		position += sizeof(hdr) + hdr.packed;
+	}
+
+	unique_ptr<ITarWriter> dst;
+	LzLevel level;
+	MemoryBudget::Share share;
+	size_t max_pending;
+	vector<BYTE> current;
+	bool incompressible = false;
+	size_t incompressible_bytes = 0; // in current
+	ULONGLONG input = 0;  // tar data given to the stage
+	ULONGLONG position = sizeof(CompressMagic); // in the stage output
+	deque<pair<shared_ptr<Block>, WorkQueue::TaskPtr>> pending; // in the order of writing
+	WorkQueue queue;      // the last: its threads use the members above
+};
+
+// reads blocks ahead and decompresses them on several threads
+class TarReaderDecompress : public ITarReader
+{
+public:
+	// the first byte of CompressMagic is read already; blocks in work take memory as frames of TarReaderFrames
+	TarReaderDecompress(unique_ptr<ITarReader>&& src, unsigned threads)
+		: src(move(src)), share((threads + 1) * 2 * BlockSize, (2 * threads + 1) * 2 * BlockSize),
+		max_pending(share.Size() / (2 * BlockSize) - 1), queue(threads)
+	{
+		char magic[sizeof(CompressMagic) - 1];
+		this->src->Read(magic, sizeof(magic));
+		if (memcmp(magic, CompressMagic + 1, sizeof(magic)) != 0)
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+	}
+	virtual void Read(void* buf, DWORD size) override
+	{
+		uint8_t* ptr = (uint8_t*)buf;
+		while (size) {
+			DWORD in_buf = DWORD(data.size() - data_read);
+			if (in_buf >= size) {
+				memcpy(ptr, data.data() + data_read, size);
+				data_read += size;
+				break;
+			}
+			if (in_buf > 0) {
+				memcpy(ptr, data.data() + data_read, in_buf);
+				ptr += in_buf;
+				size -= in_buf;
+			}
+			NextBlock();
+		}
+	}
+	virtual void Skip(ULONGLONG size) override
+	{
+		DWORD in_buf = DWORD(data.size() - data_read);
+		if (in_buf >= size) {
+			data_read += (DWORD)size;
+			return;
+		}
+		size -= in_buf;
+		data.clear();
+		data_read = 0;
+		// whole blocks are dropped if they are read already or skipped in src
+		while (!pending.empty() && pending.front().first->hdr.size <= size) {
+			size -= pending.front().first->hdr.size;
+			pending.pop_front();
+		}
+		if (pending.empty()) {
+			BlockHeader hdr;
+			while (ReadHeader(hdr)) {
+				if (hdr.size > size) {
+					Submit(hdr);
+					break;
+				}
+				src->Skip(hdr.packed);
+				position += hdr.packed;
+				size -= hdr.size;
+			}
+		}
+		if (size) {
+			NextBlock();
+			data_read = (DWORD)size;
+		}
+	}
+	// size - of the stage output in src
+	virtual bool DataSize(ULONGLONG& size) override
+	{
+		size = ReadStageFooter(src.get(), position, size);
+		return true;
+	}
+protected:
+	struct Block
+	{
+		BlockHeader hdr;
+		vector<BYTE> packed;
+		vector<BYTE> data;
+	};
+	bool ReadHeader(BlockHeader& hdr)
+	{
+		if (end_of_data)
+			return false;
+		src->Read(hdr);
+		position += sizeof(hdr);
+		if (hdr.size == 0)
+			return !(end_of_data = true);
+		if (hdr.size > BlockSize || hdr.codec > CodecLzHigh ||
+			(hdr.codec == CodecStored ? hdr.packed != hdr.size : hdr.packed >= hdr.size))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		return true;
+	}
+	void Submit(const BlockHeader& hdr)
+	{
+		auto block = make_shared<Block>();
+		block->hdr = hdr;
+		position += hdr.packed;
+		if (hdr.codec == CodecStored) {
+			block->data.resize(hdr.size);
+			src->Read(block->data.data(), hdr.size);
+			pending.push_back({ block, nullptr });
+			return;
+		}
+		block->packed.resize(hdr.packed);
+		src->Read(block->packed.data(), hdr.packed);
+		auto task = queue.Submit([block] {
+			block->data.resize(block->hdr.size);
+			if (!lz_decompress(block->packed.data(), block->packed.size(), block->data.data(), block->data.size(),
+				block->hdr.codec == CodecLzFast ? lz_fast : lz_high))
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		});
+		pending.push_back({ block, task });
+	}
+	void NextBlock()
+	{
+		BlockHeader hdr;
+		while (pending.size() < max_pending && ReadHeader(hdr))
+			Submit(hdr);
+		if (pending.empty())
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		auto [block, task] = move(pending.front());
+		pending.pop_front();
+		if (task)
+			queue.Wait(task);
+		data = move(block->data);
+		data_read = 0;
+	}
+
+	unique_ptr<ITarReader> src;
+	MemoryBudget::Share share;
+	size_t max_pending;
+	ULONGLONG position = sizeof(CompressMagic); // in src
+	bool end_of_data = false;
+	vector<BYTE> data;    // decompressed block
+	DWORD data_read = 0;  // consumed bytes
+	deque<pair<shared_ptr<Block>, WorkQueue::TaskPtr>> pending; // in the order of reading
+	WorkQueue queue;      // the last: its threads use the members above
+};
+
+// Deduplicated tar data: DedupMagic, then chunks preceded by ChunkHeader, the header with size 0 ends the data,
+// the footer follows (see WriteStageFooter).
+// Tar data is cut into chunks by content (rolling hash), so the same data gets the same chunks wherever it is;
+// a chunk stored earlier is written as a reference to its position in the stage output (its id).
+// The stage is above compression and ciphers. The reader reads referenced chunks with a second reader.
+const char DedupMagic[4] = { 'C', 'S', 'T', '2' }; // 'C' is not a type of item
+const DWORD MinChunk = 4 * 1024;
+const DWORD AvgChunk = 16 * 1024;
+const DWORD MaxChunk = 64 * 1024;
+const DWORD MinDedup = 64;   // smaller chunks (ends of items) are always stored
+
+enum ChunkType : BYTE { ChunkData, ChunkRef };
+
+struct ChunkHeader
+{
+	DWORD size;           // of tar data in the chunk, not more than MaxChunk
+	ChunkType type;
+	BYTE reserved[3];
+	ULONGLONG offset;     // ChunkRef: position of data of the stored chunk in the stage output
+};
+static_assert(sizeof(ChunkHeader) == 16);
+
+// Fingerprints of stored chunks in a table of fixed size, so memory does not grow with the archive.
+// A bucket keeps the recently used entries first, the last one is replaced: old chunks are forgotten.
+class ChunkIndex
+{
+public:
+	ChunkIndex(size_t bytes)
+		: buckets(max<size_t>(bytes / sizeof(Bucket), 1))
+	{
+	}
+	// returns false if the chunk is not known
+	bool Find(const array<uint8_t, 20>& digest, DWORD size, ULONGLONG& offset)
+	{
+		Entry* entries = Select(digest).entries;
+		for (size_t i = 0; i < Ways; ++i) {
+			if (entries[i].size == size && memcmp(entries[i].key, digest.data() + 8, sizeof(Entry::key)) == 0) {
+				offset = entries[i].offset;
+				rotate(entries, entries + i, entries + i + 1); // to the front
+				return true;
+			}
+		}
+		return false;
+	}
+	void Insert(const array<uint8_t, 20>& digest, DWORD size, ULONGLONG offset)
+	{
+		Entry* entries = Select(digest).entries;
+		memmove(entries + 1, entries, (Ways - 1) * sizeof(Entry));
+		memcpy(entries[0].key, digest.data() + 8, sizeof(Entry::key));
+		entries[0].size = size;
+		entries[0].offset = offset;
+	}
+protected:
+	static const size_t Ways = 4;
+	struct Entry
+	{
+		uint8_t key[12];      // bytes 8..19 of digest, bytes 0..7 select the bucket
+		DWORD size;           // 0 - empty
+		ULONGLONG offset;
+	};
+	struct Bucket
+	{
+		Entry entries[Ways];
+	};
+	Bucket& Select(const array<uint8_t, 20>& digest)
+	{
+		ULONGLONG h;
+		memcpy(&h, digest.data(), sizeof(h));
+		return buckets[size_t(h % buckets.size())];
+	}
+	vector<Bucket> buckets;
+};
+
+// random values for the rolling hash: hash = (hash << 1) + Gear[byte] depends on the last 64 bytes
+const array<uint64_t, 256> Gear = [] {
+	array<uint64_t, 256> gear;
+	uint64_t x = 0x9E3779B97F4A7C15;
+	for (auto& g : gear) { // splitmix64
+		uint64_t z = (x += 0x9E3779B97F4A7C15);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+		g = z ^ (z >> 31);
+	}
+	return gear;
+}();
+
+class TarWriterDedup : public ITarWriter
+{
+public:
+	// index_bytes - memory for fingerprints of chunks, the index is smaller if the memory budget has less
+	TarWriterDedup(unique_ptr<ITarWriter>&& dst, size_t index_bytes)
+		: dst(move(dst)), share(min<size_t>(index_bytes, 1024 * 1024), index_bytes), index(share.Size())
+	{
+		this->dst->Write(DedupMagic, sizeof(DedupMagic));
+		current.reserve(MaxChunk);
+	}
+	virtual void Write(const void* buf, DWORD size) override
+	{
+		// normalized chunking: the cut is harder before AvgChunk and easier after it
+		const uint64_t CutBefore = uint64_t(1) << (64 - 15);
+		const uint64_t CutAfter = uint64_t(1) << (64 - 13);
+		const BYTE* ptr = (const BYTE*)buf;
+		input += size;
+		DWORD start = 0;
+		size_t len = current.size();
+		for (DWORD i = 0; i < size; ++i) {
+			hash = (hash << 1) + Gear[ptr[i]];
+			if (++len >= MinChunk && (hash < (len < AvgChunk ? CutBefore : CutAfter) || len == MaxChunk)) {
+				current.insert(current.end(), ptr + start, ptr + i + 1);
+				start = i + 1;
+				EndChunk();
+				len = 0;
+			}
+		}
+		current.insert(current.end(), ptr + start, ptr + size);
+	}
+	virtual bool IsMyFile(const filesystem::path& path, bool is_stream) { return dst->IsMyFile(path, is_stream); }
+	virtual void Incompressible(bool on) override { dst->Incompressible(on); }
+	// data of items is chunked separately: the same files get the same chunks whatever precedes them
+	virtual void DataBoundary() override { EndChunk(); }
+	virtual void Flush() override
+	{
+		EndChunk();
+		ChunkHeader end = {};
+		dst->Write(end);
+		WriteStageFooter(dst.get(), position + sizeof(end), input);
+		dst->Flush();
+	}
+	// bytes of tar data written as references
+	ULONGLONG Deduplicated() const { return deduplicated; }
+protected:
+	void EndChunk()
+	{
+		hash = 0;
+		if (current.empty())
+			return;
+		ChunkHeader hdr = { (DWORD)current.size(), ChunkData };
+		array<uint8_t, 20> digest;
+		if (hdr.size >= MinDedup) {
+			digest = sha1_digest(current.data(), hdr.size);
+			if (index.Find(digest, hdr.size, hdr.offset)) {
+				hdr.type = ChunkRef;
+				deduplicated += hdr.size;
+			}
+			else
+				index.Insert(digest, hdr.size, position + sizeof(hdr));
+		}
+		dst->Write(hdr);
+		position += sizeof(hdr);
+		if (hdr.type == ChunkData) {
+			dst->Write(current.data(), hdr.size);
+			position += hdr.size;
+		}
+		current.clear();
+	}
+
+	unique_ptr<ITarWriter> dst;
+	MemoryBudget::Share share;
+	ChunkIndex index;
+	vector<BYTE> current;
+	uint64_t hash = 0;
+	ULONGLONG position = sizeof(DedupMagic); // in the stage output
+	ULONGLONG input = 0;  // tar data given to the stage
+	ULONGLONG deduplicated = 0;
+};
+
+// referenced chunks are read by the second reader, it goes on forward and is reopened to go back
+class TarReaderDedup : public ITarReader
+{
+public:
+	// the first byte of DedupMagic is read already, reopen - a new reader of the same data with the first byte read;
+	// the second reader is opened at once: the memory budget for its buffers is taken before extraction begins
+	TarReaderDedup(unique_ptr<ITarReader>&& src, function<unique_ptr<ITarReader>()> reopen)
+		: src(move(src)), reopen(move(reopen))
+	{
+		char magic[sizeof(DedupMagic) - 1];
+		this->src->Read(magic, sizeof(magic));
+		if (memcmp(magic, DedupMagic + 1, sizeof(magic)) != 0)
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		back = this->reopen();
+		back_position = 1;
+	}
+	virtual void Read(void* buf, DWORD size) override
+	{
+		uint8_t* ptr = (uint8_t*)buf;
+		while (size) {
+			DWORD in_buf = DWORD(chunk.size() - chunk_read);
+			if (in_buf >= size) {
+				memcpy(ptr, chunk.data() + chunk_read, size);
+				chunk_read += size;
+				break;
+			}
+			if (in_buf > 0) {
+				memcpy(ptr, chunk.data() + chunk_read, in_buf);
+				ptr += in_buf;
+				size -= in_buf;
+			}
+			NextChunk();
+		}
+	}
+	virtual void Skip(ULONGLONG size) override
+	{
+		DWORD in_buf = DWORD(chunk.size() - chunk_read);
+		if (in_buf >= size) {
+			chunk_read += (DWORD)size;
+			return;
+		}
+		size -= in_buf;
+		chunk.clear();
+		chunk_read = 0;
+		// references are not read at all, stored chunks are skipped in src
+		ChunkHeader hdr;
+		while (size) {
+			if (!ReadHeader(hdr))
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			if (hdr.size > size) {
+				Load(hdr);
+				chunk_read = (DWORD)size;
+				break;
+			}
+			if (hdr.type == ChunkData) {
+				src->Skip(hdr.size);
+				position += hdr.size;
+			}
+			size -= hdr.size;
+		}
+	}
+	// size - of the stage output in src
+	virtual bool DataSize(ULONGLONG& size) override
+	{
+		size = ReadStageFooter(src.get(), position, size);
+		return true;
+	}
+protected:
+	bool ReadHeader(ChunkHeader& hdr)
+	{
+		if (end_of_data)
+			return false;
+		src->Read(hdr);
+		position += sizeof(hdr);
+		if (hdr.size == 0)
+			return !(end_of_data = true);
+		if (hdr.size > MaxChunk || hdr.type > ChunkRef ||
+			(hdr.type == ChunkRef && (hdr.offset < sizeof(DedupMagic) + sizeof(hdr) || hdr.offset + hdr.size > position - sizeof(hdr))))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		return true;
+	}
+	void Load(const ChunkHeader& hdr)
+	{
+		chunk.resize(hdr.size);
+		if (hdr.type == ChunkData) {
+			src->Read(chunk.data(), hdr.size);
+			position += hdr.size;
+			return;
+		}
+		// the same chunk is often referenced several times in a row (zeroes, copies of a file)
+		if (hdr.offset != last_offset || hdr.size != last.size()) {
+			if (hdr.offset < back_position) {
+				back.reset(); // its memory share is returned before the new reader takes one
+				back = reopen();
+				back_position = 1;
+			}
+			back->Skip(hdr.offset - back_position);
+			last.resize(hdr.size);
+			back->Read(last.data(), hdr.size);
+			back_position = hdr.offset + hdr.size;
+			last_offset = hdr.offset;
+		}
+		memcpy(chunk.data(), last.data(), hdr.size);
+	}
+	void NextChunk()
+	{
+		ChunkHeader hdr;
+		if (!ReadHeader(hdr))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		Load(hdr);
+		chunk_read = 0;
+	}
+
+	unique_ptr<ITarReader> src;
+	function<unique_ptr<ITarReader>()> reopen;
+	ULONGLONG position = sizeof(DedupMagic); // in src
+	bool end_of_data = false;
+	vector<BYTE> chunk;    // the current chunk
+	DWORD chunk_read = 0;  // consumed bytes
+	unique_ptr<ITarReader> back;
+	ULONGLONG back_position = 0;
+	vector<BYTE> last;     // the last referenced chunk
+	ULONGLONG last_offset = 0;
+};
+
+// returns the byte read ahead, then reads src
+class TarReaderPrefix : public ITarReader
+{
+public:
+	TarReaderPrefix(unique_ptr<ITarReader>&& src, char first) : src(move(src)), first(first) {}
+	virtual void Read(void* buf, DWORD size) override
+	{
+		if (size && has_first) {
+			*(char*)buf = first;
+			has_first = false;
+			buf = (char*)buf + 1;
+			--size;
+		}
+		if (size)
+			src->Read(buf, size);
+	}
+	virtual void Skip(ULONGLONG size) override
+	{
+		if (size && has_first) {
+			has_first = false;
+			--size;
+		}
+		if (size)
+			src->Skip(size);
+	}
+	virtual bool DataSize(ULONGLONG& size) override { return src->DataSize(size); }
+protected:
+	unique_ptr<ITarReader> src;
+	char first;
+	bool has_first = true;
+};
+
+// changed items of a watched directory (see ChangeWatcher) as the tree of their paths
+struct ChangedNode
+{
+	map<PathString, ChangedNode> children;
+	bool added = false; // created or moved in: written whole
+};
+
+// Writes a segment of the watch: directories on the way to the changed items only with their headers,
+// changed files and added items whole, items which do not exist anymore as DeletedItem.
+// The untar of the segment after the previous ones (untar /g) gives the current state.
+void WriteChanged(ITarWriter* writer, const ChangedNode& node, const filesystem::path& dir, const TarOptions& options,
+	const filesystem::path& rel_path, const wstring& prefix)
+{
+	for (auto& [name, child] : node.children) {
+		if (mask_match(name.c_str(), options.exclude))
+			continue;
+		vector<filesystem::path> path = { dir / name };
+		for (auto& item : get_files_multi(*options.paths, path)) {
+			if (item.type == DirItem::Invalid || child.added) {
+				// the old item is removed first: a directory may be replaced by a file
+				WriteHeader(writer, DeletedItem, DirItem{}, ToChar(name, CP_UTF8), options);
+				if (item.type == DirItem::Invalid) {
+					++options.deleted;
+					PrintDeleted(name, prefix);
+					continue;
+				}
+			}
+			if (item.type == DirItem::Dir && !child.added) {
+				PrintFileData(item, rel_path, prefix);
+				WriteDirItem(writer, item, options);
+				WriteChanged(writer, child, path[0], options, rel_path / name, prefix + L"  ");
+				WriteEnd(writer, EndDir, options);
+			}
+			else
+				WriteTarItem(writer, item, options, rel_path, prefix);
+		}
+	}
+}
+
+// the writer to add items to existing tar-file, defined after TarIndex
+TarWriterIndex* AppendWriter(const filesystem::path& tarname, const vector<wstring>& pw, ITarWriter*& end_writer, optional<CompactHeaders>& headers);
+// checkpoints of tar, defined after AppendWriter
+void SaveTarState(ITarWriter* out, TarWriterFiles* files, const TarOptions& options);
+void SaveTarJournal(ITarWriter* out, const TarOptions& options);
+TarWriterIndex* ResumeWriter(Checkpoint& checkpoint, const filesystem::path& tarname, const vector<wstring>& pw,
+	ITarWriter*& end_writer, optional<CompactHeaders>& headers, ResumePoint& resume, map<FileId, string>& links);
 
 
 int Tar(int argc, Char** argv)
@@ -602,241 +3030,1680 @@ int Tar(int argc, Char** argv)
 
 	bool test = false;
 	ULONGLONG part_size = 0;
+	unsigned threads = 0;
+	unsigned read_threads = 0;
+	bool compact = false;
+	unsigned frame_threads = 0;
+	int compress = -1;           // LzLevel
+	unsigned compress_threads = thread::hardware_concurrency();
+	size_t dedup_memory = 0;     // for fingerprints of chunks, 0 - no deduplication
+	filesystem::path base_name;  // incremental: the previous archive
+	bool append = false;
+	unsigned watch_sec = 0;      // watch: period of segments with changed items, 0 - no watch
+	unsigned checkpoint_sec = 0; // period of checkpoints, 0 - no checkpoints
+	bool resume = false;         // continue after the checkpoint
+	optional<wstring> background; // limits of background mode
+	ULONGLONG memory_budget = 0; // for buffers of all stages, 0 - no budget
 	wstring pass;
 	filesystem::path tarname;
-	std::vector<wstring> exclude;
+	TarOptions options;
+	vector<wstring>& exclude = options.exclude;
 	std::vector<filesystem::path> items;
 
-	for (int n = 2; n < argc; ++n)
+	for (int n = 2; n < argc; ++n)
+	{
+		wstring_view param(argv[n]);
+		if (param == L"/t")
+			test = true;
+		else if (param == L"/t:s")
+			test = options.estimate = true;
+		//		else if (starts_with(param, L"/b:"))
+		//			part_size = ReadSize(param.substr(3));
+		else if (starts_with(param, L"/p:"))
+			pass = param.substr(3);
+		else if (starts_with(param, L"/e:"))
+			exclude = split(param.substr(3), L';');
+		else if (starts_with(param, L"/j:"))
+			threads = (unsigned)ReadSize(param.substr(3));
+		else if (param == L"/r")
+			options.physical_order = true;
+		else if (param == L"/x")
+			append = true;
+		else if (param == L"/b")
+			options.sums = true;
+		else if (starts_with(param, L"/a:"))
+			read_threads = (unsigned)ReadSize(param.substr(3));
+		else if (param == L"/h")
+			compact = true;
+		else if (starts_with(param, L"/c:"))
+			frame_threads = (unsigned)ReadSize(param.substr(3));
+		else if (param == L"/z")
+			compress = lz_fast;
+		else if (starts_with(param, L"/z:")) {
+			compress = lz_fast;
+			for (auto& part : split(param.substr(3), L',')) {
+				if (part == L"h")
+					compress = lz_high;
+				else
+					compress_threads = (unsigned)ReadSize(part);
+			}
+		}
+		else if (param == L"/d")
+			dedup_memory = 256 * 1024 * 1024;
+		else if (starts_with(param, L"/d:"))
+			dedup_memory = (size_t)ReadSize(param.substr(3));
+		else if (starts_with(param, L"/g:"))
+			base_name = param.substr(3);
+		else if (param == L"/w")
+			watch_sec = 10;
+		else if (starts_with(param, L"/w:"))
+			watch_sec = max(1u, (unsigned)ReadSize(param.substr(3)));
+		else if (param == L"/k")
+			checkpoint_sec = 60;
+		else if (starts_with(param, L"/k:"))
+			checkpoint_sec = max(1u, (unsigned)ReadSize(param.substr(3)));
+		else if (param == L"/u")
+			resume = true;
+		else if (param == L"/n")
+			background.emplace();
+		else if (starts_with(param, L"/n:"))
+			background = param.substr(3);
+		else if (starts_with(param, L"/q:"))
+			memory_budget = ReadSize(param.substr(3));
+		else if (starts_with(param, L"/"))
+			throw invalid_argument("unrecognized option");
+		else if (tarname.empty())
+			tarname = param;
+		else
+			items.emplace_back(param);
+	}
+
+	bool set_ext = tarname.empty() || (!tarname.has_extension() && !is_stream_name(tarname.c_str()));
+	if (tarname.empty())
+		tarname = filesystem::current_path().filename();
+	if (set_ext)
+		tarname.replace_extension(L".star");
+
+	wcout << L"Writing " << tarname.c_str();
+	if (options.estimate)
+		wcout << L", size estimation";
+	else if (test)
+		wcout << L", test";
+	if (part_size)
+		wcout << L", block size=" << part_size;
+	if (!pass.empty())
+		wcout << L", pass=" << pass;
+	if (!exclude.empty())
+		wcout << L", exclude=" << exclude;
+	if (threads)
+		wcout << L", listing threads=" << threads;
+	if (options.physical_order)
+		wcout << L", disk order reading";
+	if (read_threads)
+		wcout << L", reading threads=" << read_threads;
+	if (compact)
+		wcout << L", compact headers";
+	if (frame_threads && pass.empty())
+		frame_threads = 0; // nothing to encrypt
+	if (frame_threads)
+		wcout << L", encryption threads=" << frame_threads;
+	if (compress >= 0)
+		wcout << (compress == lz_high ? L", high compression" : L", compression") << L" on " << max(1u, compress_threads) << L" threads";
+	if (dedup_memory)
+		wcout << L", deduplication (chunk index " << FileSizeStr(dedup_memory) << L" bytes)";
+	if (!base_name.empty())
+		wcout << L", incremental to " << base_name.c_str();
+	if (options.sums)
+		wcout << L", block signatures";
+	if (append)
+		wcout << L", append";
+	if (watch_sec)
+		wcout << L", watch every " << watch_sec << L" sec";
+	if (resume && !checkpoint_sec)
+		checkpoint_sec = 60;
+	if (checkpoint_sec)
+		wcout << L", checkpoints every " << checkpoint_sec << L" sec";
+	if (resume)
+		wcout << L", resume";
+	// before threads are started: they inherit the priority
+	optional<Throttle> throttle;
+	if (background) {
+		throttle.emplace(*background);
+		wstring limits = throttle->Description();
+		wcout << L", background" << (limits.empty() ? L"" : L" (" + limits + L")");
+	}
+	// before the stages are created: they take their buffers from it
+	optional<MemoryBudget> budget;
+	if (memory_budget) {
+		budget.emplace(memory_budget);
+		wcout << L", memory budget " << FileSizeStr(memory_budget) << L" bytes";
+	}
+	if (!items.empty())
+		wcout << L", items=" << items;
+	else
+		wcout << L", current dir";
+	wcout << endl << endl;
+
+	if (append && (test || frame_threads || compress >= 0 || dedup_memory))
+		throw invalid_argument("/x can not be used with /t, /c, /z, /d");
+	if (watch_sec && (test || append || !base_name.empty()))
+		throw invalid_argument("/w can not be used with /t, /x, /g");
+	// states of framing, compression and deduplication are not saved
+	if (checkpoint_sec && (test || append || watch_sec || frame_threads || compress >= 0 || dedup_memory))
+		throw invalid_argument("/k and /u can not be used with /t, /x, /w, /c, /z, /d");
+
+	// watch: the directories are watched as they are archived, segments are not archived
+	vector<filesystem::path> roots;
+	filesystem::path cwd = filesystem::current_path();
+	if (watch_sec) {
+		for (auto& item : items) {
+			filesystem::path dir = filesystem::absolute(item).lexically_normal();
+			if (!dir.has_filename()) // "dir\" or "."
+				dir = dir.parent_path();
+			if (!filesystem::is_directory(dir))
+				throw MyException{ L"Path is not a directory: '<path>'", dir.c_str(), 0 };
+			roots.push_back(dir);
+		}
+		items = roots;
+		exclude.push_back(tarname.filename().wstring());
+		exclude.push_back(tarname.stem().wstring() + L".*" + tarname.extension().wstring());
+		// segments of a previous watch would be untarred after the new archive
+		filesystem::path dir = filesystem::absolute(tarname).parent_path();
+		PathString stem = tarname.stem().native() + L".", ext = tarname.extension().native();
+		error_code ec;
+		for (auto& entry : filesystem::directory_iterator(dir, ec)) {
+			PathString name = entry.path().filename().native();
+			if (name.size() >= stem.size() + 4 + ext.size() && name.starts_with(stem) && name.ends_with(ext) &&
+				all_of(name.begin() + stem.size(), name.end() - ext.size(), [](wchar_t c) { return c >= '0' && c <= '9'; }))
+				throw MyException{ L"Segment of a previous watch exists, remove it first: '<path>'", entry.path().c_str(), 0 };
+		}
+	}
+
+	if (options.estimate) {
+		// only metadata is needed, listing is the whole work
+		if (!threads)
+			threads = max(4u, thread::hardware_concurrency());
+		read_threads = 0;
+		options.physical_order = false;
+	}
+
+	BaseManifest base;
+	if (!base_name.empty()) {
+		vector<wstring> pw;
+		if (!pass.empty())
+			pw = split(pass, ',');
+		if (!base.Load(base_name.c_str(), pw))
+			throw MyException{ L"Tar-file has no index: '<path>'", base_name.c_str(), 0 };
+		options.base = &base;
+	}
+
+	PathTable paths;
+	options.paths = &paths;
+	auto gen = items.empty() ?
+		get_files(paths, paths.Add(DirItem::NoParent, cwd.native())) :
+		get_files_multi(paths, items);
+
+	unique_ptr<Checkpoint> checkpoint;
+	if (checkpoint_sec)
+		checkpoint = make_unique<Checkpoint>(filesystem::path(tarname) += L".ckpt",
+			pass.empty() ? vector<wstring>() : split(pass, ','), checkpoint_sec);
+	ResumePoint resume_point;
+
+	unique_ptr<ITarWriter> writer;
+	ITarWriter* end_writer = nullptr;
+	CompactHeaders headers;
+	TarWriterDedup* dedup = nullptr;
+	// the chain of writers to tar-file 'name' (every segment of the watch has its own)
+	auto open_writer = [&](const filesystem::path& name) {
+		writer.reset();
+		headers = CompactHeaders();
+		options.headers = nullptr;
+		if (append || resume) {
+			// the format is taken from the tar-file, /h is ignored
+			optional<CompactHeaders> state;
+			vector<wstring> pw = pass.empty() ? vector<wstring>() : split(pass, ',');
+			if (append)
+				options.index = AppendWriter(name, pw, end_writer, state);
+			else {
+				options.index = ResumeWriter(*checkpoint, name, pw, end_writer, state, resume_point, options.links);
+				options.resume = &resume_point;
+			}
+			writer = unique_ptr<ITarWriter>(options.index);
+			compact = false;
+			if (state) {
+				headers = move(*state);
+				options.headers = &headers;
+			}
+		}
+		else {
+			writer = unique_ptr<ITarWriter>(
+				test ? (ITarWriter*)new TarWriterTest() :
+				(ITarWriter*)new TarWriterFiles(name, part_size));
+			end_writer = writer.get();
+		}
+
+		if (test || append || resume)
+			;
+		else if (frame_threads) // frames are written whole, no buffer is needed
+			writer = unique_ptr<ITarWriter>(new TarWriterFrames(move(writer), PasswordDigests(split(pass, ',')), frame_threads));
+		else {
+			writer = unique_ptr<ITarWriter>(new TarWriterBuffer(move(writer)));
+			if (!pass.empty())
+				writer = CipherWriter(move(writer), PasswordDigests(split(pass, ',')), random_iv());
+		}
+		if (!test && compress >= 0) {
+			writer = unique_ptr<ITarWriter>(new TarWriterCompress(move(writer), (LzLevel)compress, max(1u, compress_threads)));
+			options.compress = true;
+		}
+		dedup = nullptr;
+		if (!test && dedup_memory) {
+			dedup = new TarWriterDedup(move(writer), dedup_memory);
+			writer = unique_ptr<ITarWriter>(dedup);
+		}
+		if (!append && !resume) {
+			options.index = new TarWriterIndex(move(writer));
+			writer = unique_ptr<ITarWriter>(options.index);
+		}
+		if (checkpoint)
+			options.index->KeepRecent(64 * 1024); // more than the buffer and the ciphers hold (see ResumeWriter)
+		if (compact) {
+			writer->Write(FormatHeader);
+			writer->Write(FormatCompact);
+			options.headers = &headers;
+		}
+	};
+	open_writer(tarname);
+	if (checkpoint) {
+		checkpoint->state = [&](ITarWriter* out) { SaveTarState(out, static_cast<TarWriterFiles*>(end_writer), options); };
+		checkpoint->journal = [&](ITarWriter* out) { SaveTarJournal(out, options); };
+		options.checkpoint = checkpoint.get();
+	}
+
+	high_resolution_clock::time_point begin_time = high_resolution_clock::now();
+
+	unique_ptr<ParallelLister> lister;
+	if (threads) {
+		lister = make_unique<ParallelLister>(paths, threads, exclude, 64 * 1024 * 1024);
+		options.lister = lister.get();
+	}
+	unique_ptr<Prefetcher> prefetcher;
+	if (read_threads) {
+		prefetcher = make_unique<Prefetcher>(read_threads, 32 * read_threads, 64 * 1024 * 1024);
+		options.prefetcher = prefetcher.get();
+	}
+	optional<MemoryBudget::Share> ordered_share; // files of directories read in the order on disk
+	if (options.physical_order && !prefetcher) {
+		ordered_share.emplace(0, 64 * 1024 * 1024);
+		options.max_prefetched = ordered_share->Size();
+	}
+	unique_ptr<ChangeWatcher> watcher; // before the listing: changes made while it goes are not lost
+	if (watch_sec)
+		watcher = make_unique<ChangeWatcher>(roots.empty() ? vector<filesystem::path>{ cwd } : roots);
+	TarFiles(writer.get(), std::move(gen), options, L"", L"");
+	if (options.resume)
+		EndMissing(writer.get(), options, 0);
+	if (options.base)
+		WriteDeleted(writer.get(), IndexNoParent, options, L"");
+	writer->Write(EndArchive);
+	options.index->WriteIndex();
+	writer->Flush();
+	if (checkpoint)
+		checkpoint->Remove();
+
+	high_resolution_clock::time_point end_time = high_resolution_clock::now();
+	duration<double> time_span = duration_cast<duration<double>>(end_time - begin_time);
+
+	if (options.base)
+		wcout << options.unchanged << L" unchanged files, " << options.deleted << L" deleted items" << endl;
+	if (options.delta)
+		wcout << FileSizeStr(options.delta) << L" bytes of changed files taken from the base" << endl;
+	if (options.estimate) {
+		ULONGLONG size = end_writer->written_total - 4; // TarWriterTest counts a header which is not written
+		size_t layers = pass.empty() ? 0 : split(pass, ',').size();
+		size = frame_threads ? FramedSize(size, layers) : EncryptedSize(size, layers);
+		// file data is counted in full: hard links and deltas to the base are stored smaller,
+		// compressed and deduplicated data is not known without reading the files
+		wcout << L"Size of " << tarname.filename().c_str() << L" will be at most " << FileSizeStr(size) << L" bytes";
+		if (compress >= 0 || dedup_memory)
+			wcout << L" before " << (compress < 0 ? L"deduplication" : dedup_memory ? L"compression and deduplication" : L"compression");
+		wcout << L" (" << time_span.count() << L" sec)" << endl;
+		PrintPeakMemory();
+		return 0;
+	}
+	wcout << FileSizeStr(end_writer->written_total) << L" bytes wirtten in " << tarname.filename().c_str()
+		<< L" (" << time_span.count() << L" sec)" << endl;
+	if (dedup)
+		wcout << FileSizeStr(dedup->Deduplicated()) << L" bytes of repeated data stored as references" << endl;
+	PrintPeakMemory();
+	if (!watch_sec)
+		return 0;
+
+	// Watch: changes are collected for watch_sec after the first one, then the changed items are written in
+	// the next segment (stem.0001.ext etc.). If events are lost, all items are written again, untar starts from it.
+	// It runs until the process is stopped.
+	// Changes of excluded items (the archive and its segments among them) are dropped, a segment is not
+	// written if nothing else changed: otherwise writing of a segment would be the change for the next one.
+	vector<map<PathString, bool>> changes;
+	for (unsigned segment = 1; ; ++segment) {
+		bool complete;
+		vector<ChangedNode> trees;
+		for (bool any = false; !any; ) {
+			complete = watcher->Wait(watch_sec * 1000, changes);
+			any = !complete;
+			trees.assign(changes.size(), {});
+			for (size_t i = 0; i < changes.size(); ++i) {
+				for (auto& [path, added] : changes[i]) {
+					vector<PathString> names;
+					bool stream = false;
+					for (auto& part : filesystem::path(path)) {
+						PathString name = part.native();
+						stream = name.find(':') != PathString::npos; // the change of its file or directory
+						name.resize(name.find(':') == PathString::npos ? name.size() : name.find(':'));
+						if (name.empty())
+							break;
+						names.push_back(name);
+						if (stream)
+							break;
+					}
+					if (names.empty() || any_of(names.begin(), names.end(),
+						[&](const PathString& name) { return mask_match(name.c_str(), exclude); }))
+						continue;
+					ChangedNode* node = &trees[i];
+					for (auto& name : names)
+						node = &node->children[name];
+					node->added |= added && !stream;
+					any = true;
+				}
+			}
+		}
+		wchar_t number[16];
+		swprintf(number, size(number), L".%04u", segment);
+		filesystem::path name = tarname;
+		name.replace_filename(tarname.stem().wstring() + number + tarname.extension().wstring());
+		wcout << endl << L"Writing " << name.c_str();
+		if (!complete) {
+			wcout << L", all items: events are lost, untar from this segment";
+			watcher.reset();
+			watcher = make_unique<ChangeWatcher>(roots.empty() ? vector<filesystem::path>{ cwd } : roots);
+		}
+		wcout << endl << endl;
+
+		begin_time = high_resolution_clock::now();
+		open_writer(name);
+		options.links.clear(); // the first names of files are in the previous segments
+		options.deleted = 0;
+		if (!complete)
+			TarFiles(writer.get(), items.empty() ?
+				get_files(paths, paths.Add(DirItem::NoParent, cwd.native())) :
+				get_files_multi(paths, items), options, L"", L"");
+		else {
+			for (size_t i = 0; i < trees.size(); ++i) {
+				ChangedNode& tree = trees[i];
+				if (tree.children.empty())
+					continue;
+				if (roots.empty()) // items of the current directory are at the top
+					WriteChanged(writer.get(), tree, cwd, options, L"", L"");
+				else {
+					ChangedNode top;
+					top.children[roots[i].filename().native()] = move(tree);
+					WriteChanged(writer.get(), top, roots[i].parent_path(), options, L"", L"");
+				}
+			}
+		}
+		writer->Write(EndArchive);
+		options.index->WriteIndex();
+		writer->Flush();
+
+		time_span = duration_cast<duration<double>>(high_resolution_clock::now() - begin_time);
+		if (options.deleted)
+			wcout << options.deleted << L" deleted items" << endl;
+		wcout << FileSizeStr(end_writer->written_total) << L" bytes wirtten in " << name.filename().c_str()
+			<< L" (" << time_span.count() << L" sec)" << endl;
+		PrintPeakMemory();
+	}
+}
+
+
+struct Options
+{
+	wstring stream_separator;
+	bool test = false;
+	bool overwrite = false;
+	bool sync = false;        // skip files which have the same size and time
+	bool sync_verify = false; // ... and compare their contents, only differing parts are written
+	vector<wstring> include;  // masks of names or paths in tar-file to extract, all if empty
+	mutable ULONGLONG unchanged = 0; // counter of skipped files
+	Checkpoint* checkpoint = nullptr; // saves the state between items (untar /k), if not null
+	ITarReader* resume = nullptr;     // the state of the checkpoint to continue from (untar /u), if not null
+	DWORD archive = 0;                // number of the tar-file in the chain (untar /g), for checkpoints
+};
+
+void EnsureDirectoryExists(const filesystem::path& dir)
+{
+	if (!filesystem::exists(dir))
+		filesystem::create_directories(dir);
+	else if (!filesystem::is_directory(dir))
+		throw MyException{ L"Path is not a directory: '<path>'", dir.c_str(), 0 };
+}
+
+bool WriteTo(const wchar_t* dest, ITarReader* reader, ULONGLONG total, const Options& options, const wstring& prefix)
+{
+	// wcout << dest << endl;
+	FileSimple fs_out;
+	if (!options.test)
+	{
+		const wchar_t* msg = nullptr;
+		if (filesystem::exists(dest) && !options.overwrite && !options.sync)
+			msg = L"already exists";
+		else if (!fs_out.Open(dest, true, true))
+			msg = L"failed to create";
+		if (msg)
+		{
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << prefix << L"* " << dest << L"  *** " << msg << L" ***" << endl;
+		}
+	}
+	if (!fs_out.IsOpen()) { // test or error: data is not needed, reader can seek over it
+		reader->Skip(total);
+		return false;
+	}
+
+	while (total != 0)
+	{
+		BYTE buf[64 * 1024];
+		SetLastError(0);
+		ULONGLONG to_read = sizeof(buf);
+		if (to_read > total)
+			to_read = total;
+		reader->Read(buf, (DWORD)to_read);
+		DWORD dwBytesWritten = fs_out.Write(buf, (DWORD)to_read);
+		if (dwBytesWritten != (DWORD)to_read)
+			throw MyException{ L"Failed to write '<path>': <err>", dest, GetLastError() };
+		total -= to_read;
+	}
+	return true;
+}
+
+bool IsSameFile(const wchar_t* dest, const DirItem& di, bool check_time)
+{
+	WIN32_FILE_ATTRIBUTE_DATA adata;
+	if (!GetFileAttributesEx(dest, GetFileExInfoStandard, &adata) ||
+		(adata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		return false;
+	ULARGE_INTEGER fsize;
+	fsize.LowPart = adata.nFileSizeLow;
+	fsize.HighPart = adata.nFileSizeHigh;
+	return fsize.QuadPart == di.size &&
+		(!check_time || CompareFileTime(&adata.ftLastWriteTime, &di.ftLastWriteTime) == 0);
+}
+
+// compares existing file with the data in tar and rewrites only differing part,
+// returns true if something is written
+bool SyncTo(const wchar_t* dest, ITarReader* reader, ULONGLONG total, const wstring& prefix)
+{
+	FileSimple fs_out;
+	if (!fs_out.OpenRW(dest))
+	{
+		ConsoleColor cc(FOREGROUND_RED);
+		wcout << prefix << L"* " << dest << L"  *** failed to open *** " << endl;
+		reader->Skip(total);
+		return false;
+	}
+	bool differs = false;
+	while (total != 0)
+	{
+		BYTE buf[64 * 1024];
+		BYTE old[64 * 1024];
+		DWORD to_read = total < sizeof(buf) ? (DWORD)total : sizeof(buf);
+		reader->Read(buf, to_read);
+		if (!differs) {
+			DWORD dwBytesRead = fs_out.Read(old, to_read);
+			differs = dwBytesRead != to_read || memcmp(buf, old, to_read) != 0;
+			if (differs) // return back and write from here
+				fs_out.Seek(-LONGLONG(dwBytesRead));
+		}
+		if (differs && fs_out.Write(buf, to_read) != to_read)
+			throw MyException{ L"Failed to write '<path>': <err>", dest, GetLastError() };
+		total -= to_read;
+	}
+	return differs;
+}
+
+// returns true if the item is written, false if it is skipped as unchanged
+bool SyncOrWrite(const wchar_t* dest, ITarReader* reader, const DirItem& di, bool check_time, const Options& options, const wstring& prefix)
+{
+	if (options.test || !IsSameFile(dest, di, check_time))
+		return WriteTo(dest, reader, di.size, options, prefix);
+	if (options.sync_verify)
+		return SyncTo(dest, reader, di.size, prefix);
+	reader->Skip(di.size);
+	return false;
+}
+
+// DeltaFile (see WriteDelta): the file is rebuilt from its base version extracted before, the blocks of which
+// are read in one pass if they are taken in order; the file on disk is the base version if it has the size and
+// the last write time of the base; dest = null - the data is skipped
+bool PatchTo(const wchar_t* dest, ITarReader* reader, const DirItem& di, const Options& options, const wstring& prefix)
+{
+	ULONGLONG base_size;
+	FILETIME base_time;
+	reader->Read(base_size);
+	reader->Read(base_time);
+	FileSimple fs_base, fs_out;
+	wstring temp;
+	if (dest && !options.test)
+	{
+		temp = wstring(dest) + L".delta";
+		const wchar_t* msg = nullptr;
+		FILE_BASIC_INFO fbi;
+		if (!fs_base.Open(dest, false, true) || fs_base.GetLength64() != base_size || !fs_base.GetAttribs(&fbi) ||
+			CompareFileTime((const FILETIME*)&fbi.LastWriteTime, &base_time) != 0)
+			msg = L"base version not found";
+		else if (!fs_out.Open(temp.c_str(), true, true))
+			msg = L"failed to create";
+		if (msg)
+		{
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << prefix << L"* " << dest << L"  *** " << msg << L" ***" << endl;
+		}
+	}
+
+	vector<BYTE> buf(fs_out.IsOpen() ? DeltaBlock : 0);
+	ULONGLONG base_pos = 0;
+	ULONGLONG written = 0;
+	for (;;) {
+		BYTE op;
+		reader->Read(op);
+		if (op == DeltaEnd)
+			break;
+		if (op == DeltaCopy) {
+			ULONGLONG first = ReadVarint(reader);
+			ULONGLONG count = ReadVarint(reader);
+			if (count > (di.size - written) / DeltaBlock || first > base_size / DeltaBlock || count > base_size / DeltaBlock - first)
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			written += count * DeltaBlock;
+			if (!fs_out.IsOpen())
+				continue;
+			if (base_pos != first * DeltaBlock && !fs_base.Seek(LONGLONG(first * DeltaBlock), FILE_BEGIN))
+				throw MyException{ L"Failed to read '<path>': <err>", dest, GetLastError() };
+			base_pos = (first + count) * DeltaBlock;
+			for (; count; --count) {
+				if (fs_base.Read(buf.data(), DeltaBlock) != DeltaBlock)
+					throw MyException{ L"Failed to read '<path>': <err>", dest, GetLastError() };
+				if (fs_out.Write(buf.data(), DeltaBlock) != DeltaBlock)
+					throw MyException{ L"Failed to write '<path>': <err>", temp.c_str(), GetLastError() };
+			}
+		}
+		else if (op == DeltaData) {
+			ULONGLONG size = ReadVarint(reader);
+			if (size > di.size - written)
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			written += size;
+			if (!fs_out.IsOpen()) {
+				reader->Skip(size);
+				continue;
+			}
+			while (size) {
+				DWORD part = size < DeltaBlock ? (DWORD)size : DeltaBlock;
+				reader->Read(buf.data(), part);
+				if (fs_out.Write(buf.data(), part) != part)
+					throw MyException{ L"Failed to write '<path>': <err>", temp.c_str(), GetLastError() };
+				size -= part;
+			}
+		}
+		else
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+	}
+	if (written != di.size)
+		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+	if (!fs_out.IsOpen())
+		return false;
+
+	fs_out.Close();
+	fs_base.Close();
+	error_code ec;
+	filesystem::rename(temp, dest, ec);
+	if (ec)
+	{
+		filesystem::remove(temp, ec);
+		ConsoleColor cc(FOREGROUND_RED);
+		wcout << prefix << L"* " << dest << L"  *** failed to replace *** " << endl;
+		return false;
+	}
+	return true;
+}
+
+DirItem::Type ItemType(char type)
+{
+	return type == BeginDir ? DirItem::Dir : type == BeginStream ? DirItem::Stream : DirItem::File;
+}
+
+// Extracts tar items in a loop with explicit stack of opened directories and files instead of recursion.
+// Buffers for names, paths and indent are kept for the whole archive, so decoding of the entry header
+// does not allocate memory once the buffers have grown to the longest name.
+class TarExtractor
+{
+public:
+	TarExtractor(ITarReader* reader, const Options& options, const filesystem::path& dest)
+		: reader(reader), options(options), path(dest.c_str()), dest_len(path.size()), root(path)
+	{
+		stack.reserve(64);
+	}
+
+	// destination of the whole tar-file if dest is a directory inside of it, hard links refer to it
+	void SetRoot(const filesystem::path& dest_root)
+	{
+		root = dest_root.c_str();
+	}
+
+	// headers of items are compact, with the state of the position in tar-file
+	void SetCompact(CompactHeaders headers)
+	{
+		compact = move(headers);
+	}
+
+	// the items are extracted by index: paths in tar-file of the selected items; hard links whose first name is
+	// outside of them are not created, their first names and paths are added to 'missing' to write the data later
+	void SetSelection(const vector<wstring>* items, vector<pair<wstring, wstring>>* missing)
+	{
+		selection = items;
+		missing_links = missing;
+	}
+
+	// the extracted item gets this name instead of its name in tar-file
+	void SetName(const wstring& new_name)
+	{
+		rename = new_name;
+	}
+
+	// saves the state between items of directories
+	void SetCheckpoint(Checkpoint* cp)
+	{
+		checkpoint = cp;
+	}
+
+	// the state for checkpoints: open directories and compact headers
+	void SaveState(ITarWriter* out) const
+	{
+		WriteItems(out, wstring_view(path).substr(dest_len));
+		WriteVarint(out, stack.size());
+		for (auto& level : stack)
+			WriteVarint(out, level.path_len - dest_len);
+		WriteVarint(out, options.unchanged);
+		BYTE has_compact = compact.has_value();
+		out->Write(has_compact);
+		if (compact)
+			compact->SaveState(out);
+	}
+	void LoadState(ITarReader* in)
+	{
+		wstring rel;
+		ReadItems(in, rel);
+		path.resize(dest_len);
+		path += rel;
+		stack.resize((size_t)min<ULONGLONG>(ReadVarint(in), 0x10000));
+		for (auto& level : stack) {
+			level = { DirItem::Dir, dest_len + (size_t)ReadVarint(in) };
+			if (level.path_len > path.size())
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		}
+		prefix.assign(stack.size() * 2, L' ');
+		options.unchanged = ReadVarint(in);
+		BYTE has_compact;
+		in->Read(has_compact);
+		if (has_compact) {
+			compact.emplace();
+			compact->LoadState(in);
+		}
+	}
+
+	// single - extract only one item with its contents
+	void Run(bool single = false)
+	{
+		for (;;) {
+			if (checkpoint && (stack.empty() || stack.back().type == DirItem::Dir))
+				checkpoint->Check();
+			char type;
+			reader->Read(type);
+			switch (type) {
+			case BeginDir:
+			case BeginFile:
+			case BeginStream:
+			case BeginLink:
+			case UnchangedFile:
+			case DeletedItem:
+			case DeltaFile:
+				BeginItem(type);
+				if (single && stack.empty())
+					return;
+				break;
+			case EndFile:
+			case EndDir:
+			case EndArchive:
+				if (stack.empty())
+					return;
+				EndItem();
+				if (single && stack.empty())
+					return;
+				break;
+			case FormatHeader: {
+				BYTE flags;
+				reader->Read(flags);
+				if (!stack.empty() || (flags & ~FormatCompact))
+					throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+				if (flags & FormatCompact)
+					SetCompact(CompactHeaders());
+				break;
+			}
+			default:
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			}
+		}
+	}
+
+protected:
+	struct Level
+	{
+		DirItem::Type type;   // Dir or File (its streams follow)
+		size_t path_len;      // length of path of the parent directory
+		bool written;         // File: data is written, attributes must be set
+		bool untouched;       // File: sync mode, neither data nor streams are rewritten
+		DWORD dwFileAttributes;
+		FILETIME ftLastWriteTime;
+		bool selected = true; // is extracted, else only passed through
+	};
+
+	void ReadHeader(char type)
+	{
+		if (compact) {
+			di.type = ItemType(type);
+			compact->Read(reader, type, di, name_utf8);
+		}
+		else {
+			di.size = 0;
+			di.type = ItemType(type);
+			if (HasSize(type))
+				reader->Read(di.size);
+			if (HasFileInfo(type)) {
+				reader->Read(di.dwFileAttributes);
+				reader->Read(di.ftLastWriteTime);
+			}
+			ReadString(name_utf8, 500);
+		}
+		if (!IsUtf8(name_utf8.data(), (int)name_utf8.size(), true))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		ToWideChar(name_utf8, CP_UTF8, name);
+		if (type == BeginLink) {
+			ReadString(name_utf8, 32767);
+			if (!IsUtf8(name_utf8.data(), (int)name_utf8.size(), true))
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			ToWideChar(name_utf8, CP_UTF8, link);
+		}
+	}
+
+	// WORD length, then UTF-8 string
+	void ReadString(string& str, WORD max_len)
+	{
+		WORD wlen;
+		reader->Read(wlen);
+		if (wlen > max_len)
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		str.resize(wlen);
+		reader->Read(str.data(), wlen);
+	}
+
+	static void AppendName(wstring& dst, size_t dir_len, wstring_view name)
+	{
+		dst.resize(dir_len);
+		if (!dst.empty() && dst.back() != L'\\' && dst.back() != L'/')
+			dst += L'\\';
+		dst += name;
+	}
+
+	// include masks: the item matches itself, or is inside of matching directory or file
+	bool IsSelected(const Level* parent)
+	{
+		if (options.include.empty() || (parent && parent->selected))
+			return true;
+		if (parent && di.type == DirItem::Stream)
+			return false;
+		AppendName(rel_path, 0, wstring_view(path).substr(dest_len));
+		while (!rel_path.empty() && (rel_path[0] == L'\\' || rel_path[0] == L'/'))
+			rel_path.erase(0, 1);
+		AppendName(rel_path, rel_path.size(), name);
+		return mask_match(name.c_str(), options.include) || mask_match(rel_path.c_str(), options.include);
+	}
+
+	// the item with this path in tar-file is extracted: selected itself or inside of selected directory
+	bool IsSelected(const wstring& tar_path) const
 	{
-		wstring_view param(argv[n]);
-		if (param == L"/t")
-			test = true;
-		//		else if (starts_with(param, L"/b:"))
-		//			part_size = ReadSize(param.substr(3));
-		else if (starts_with(param, L"/p:"))
-			pass = param.substr(3);
-		else if (starts_with(param, L"/e:"))
-			exclude = split(param.substr(3), L';');
-		else if (starts_with(param, L"/"))
-			throw invalid_argument("unrecognized option");
-		else if (tarname.empty())
-			tarname = param;
-		else
-			items.emplace_back(param);
+		if (selection) {
+			for (auto& item : *selection) {
+				if (_wcsnicmp(tar_path.c_str(), item.c_str(), item.size()) == 0 &&
+					(tar_path.size() == item.size() || tar_path[item.size()] == L'\\'))
+					return true;
+			}
+			return false;
+		}
+		if (options.include.empty())
+			return true;
+		for (size_t begin = 0;;) {
+			size_t end = tar_path.find(L'\\', begin);
+			wstring dir_name = tar_path.substr(begin, end - begin);
+			wstring dir_path = tar_path.substr(0, end);
+			if (mask_match(dir_name.c_str(), options.include) || mask_match(dir_path.c_str(), options.include))
+				return true;
+			if (end == wstring::npos)
+				return false;
+			begin = end + 1;
+		}
 	}
 
-	bool set_ext = tarname.empty() || (!tarname.has_extension() && !is_stream_name(tarname.c_str()));
-	if (tarname.empty())
-		tarname = filesystem::current_path().filename();
-	if (set_ext)
-		tarname.replace_extension(L".star");
+	// not selected item: its data is skipped, the reader seeks over it if possible
+	void PassItem(char type)
+	{
+		switch (di.type)
+		{
+		case DirItem::Dir:
+			stack.push_back({ DirItem::Dir, path.size() });
+			stack.back().selected = false;
+			AppendName(path, path.size(), name);
+			break;
+		case DirItem::File:
+			if (type == DeltaFile)
+				PatchTo(nullptr, reader, di, options, prefix);
+			else
+				reader->Skip(di.size);
+			stack.push_back({ DirItem::File, path.size() });
+			stack.back().selected = false;
+			AppendName(path, path.size(), name);
+			break;
+		case DirItem::Stream:
+			reader->Skip(di.size);
+			break;
+		}
+	}
 
-	wcout << L"Writing " << tarname.c_str();
-	if (test)
-		wcout << L", test";
-	if (part_size)
-		wcout << L", block size=" << part_size;
-	if (!pass.empty())
-		wcout << L", pass=" << pass;
-	if (!exclude.empty())
-		wcout << L", exclude=" << exclude;
-	if (!items.empty())
-		wcout << L", items=" << items;
-	else
-		wcout << L", current dir";
-	wcout << endl << endl;
+	void BeginItem(char type)
+	{
+		ReadHeader(type);
+		if (stack.empty() && !rename.empty())
+			name = rename;
 
-	auto gen = items.empty() ?
-		get_files(filesystem::current_path()) :
-		get_files_multi(items);
+		Level* file = !stack.empty() && stack.back().type == DirItem::File ? &stack.back() : nullptr;
+		if (file && di.type != DirItem::Stream) // only streams can be inside of file
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
 
-	unique_ptr<ITarWriter> writer(
-		test ? (ITarWriter*)new TarWriterTest() :
-		(ITarWriter*)new TarWriterFiles(tarname, part_size));
+		Level* parent = stack.empty() ? nullptr : &stack.back();
+		bool no_data = type == BeginLink || type == UnchangedFile || type == DeletedItem;
+		if (!IsSelected(parent))
+			return no_data ? void() : PassItem(type);
+		if (type == DeletedItem)
+			return DeleteItem();
+		if (parent && !parent->selected) { // the first selected item in the branch: print its path, create directories
+			PrintFileData(di.type, type == BeginLink ? rel_path + L" -> " + link : rel_path, di.size, prefix);
+			if (!options.test)
+				EnsureDirectoryExists(path);
+		}
+		else
+			PrintFileData(di.type, type == BeginLink ? name + L" -> " + link : name, di.size, prefix);
+		if (type == BeginLink)
+			return CreateLink();
+		if (type == UnchangedFile) // is extracted from the base archive
+			return;
 
-	ITarWriter* end_writer = writer.get();
+		switch (di.type)
+		{
+		case DirItem::Dir:
+			stack.push_back({ DirItem::Dir, path.size() });
+			AppendName(path, path.size(), name);
+			prefix += L"  ";
+			if (!options.test)
+				EnsureDirectoryExists(path);
+			break;
+		case DirItem::File: {
+			Level level = { DirItem::File, path.size(), false, false, di.dwFileAttributes, di.ftLastWriteTime };
+			AppendName(path, path.size(), name);
+			if (type == DeltaFile) {
+				bool same = options.sync && !options.test && IsSameFile(path.c_str(), di, true);
+				level.written = PatchTo(same ? nullptr : path.c_str(), reader, di, options, prefix);
+				level.untouched = same;
+			}
+			else if (options.sync) {
+				level.written = SyncOrWrite(path.c_str(), reader, di, true, options, prefix);
+				level.untouched = !level.written && !options.test;
+			}
+			else
+				level.written = WriteTo(path.c_str(), reader, di.size, options, prefix);
+			stack.push_back(level);
+			break;
+		}
+		case DirItem::Stream: {
+			if (!options.stream_separator.empty()) {
+				// replace ':' with stream_separator
+				if (auto pos = name.find(L':'); pos != wstring::npos)
+					name.replace(pos, 1, options.stream_separator);
+			}
+			// stream name contains file name: "file:stream" or ":stream" for directory
+			AppendName(stream_path, 0, path);
+			AppendName(stream_path, file ? file->path_len : path.size(), name);
+			CorrectDirStreamName(stream_path);
+			// stream of unchanged file is checked by size, stream of directory only by contents
+			bool written;
+			if (options.sync && (file ? file->untouched : options.sync_verify))
+				written = SyncOrWrite(stream_path.c_str(), reader, di, false, options, prefix);
+			else
+				written = WriteTo(stream_path.c_str(), reader, di.size, options, prefix);
+			if (written && file)
+				file->untouched = false;
+			break;
+		}
+		}
+	}
 
-	if (!test)
-		writer = unique_ptr<ITarWriter>(new TarWriterBuffer(move(writer)));
+	// the item is extracted from the base archive and deleted after it
+	void DeleteItem()
+	{
+		PrintDeleted(name, prefix);
+		AppendName(item_path, 0, path);
+		AppendName(item_path, item_path.size(), name);
+		if (options.test)
+			return;
+		error_code ec;
+		filesystem::remove_all(item_path, ec);
+		if (ec)
+		{
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << prefix << L"* " << item_path << L"  *** failed to delete *** " << endl;
+		}
+	}
 
-	if (!test && !pass.empty()) {
-		vector<wstring> pw = split(pass, ',');
-		for (int i = (int)pw.size() - 1; i >= 0; --i) {
-			string utf8 = ToChar(pw[i], CP_UTF8);
-			array<uint8_t, 20> digest = sha1_digest(utf8.data(), (unsigned int)utf8.size());
-			unique_ptr<ITarWriter> dst = move(writer);
-			if (i & 1)
-				writer = unique_ptr<ITarWriter>(new TarWriterShaker(move(dst), digest.data()));
-			else {
-				array<uint8_t, 16> key = digest_to_key(digest);
-				array<uint8_t, 16> iv;
-				if (i == 0)
-					iv = random_iv();
-				writer = unique_ptr<ITarWriter>(new TarWriterAES(move(dst), key.data(), i == 0 ? iv.data() : nullptr));
+	// the file is extracted already with its first name (path in tar-file in 'link')
+	void CreateLink()
+	{
+		AppendName(item_path, 0, path);
+		AppendName(item_path, item_path.size(), name);
+		AppendName(target_path, 0, root);
+		AppendName(target_path, target_path.size(), link);
+		if (options.test)
+			return;
+		if (!IsSelected(link)) { // the data is not written with the first name
+			if (missing_links)
+				return missing_links->push_back({ link, item_path });
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << prefix << L"* " << item_path << L"  *** skipped, its first name is not selected: " << link << L" ***" << endl;
+			return;
+		}
+		error_code ec;
+		const wchar_t* msg = nullptr;
+		if (filesystem::exists(item_path, ec)) {
+			if (filesystem::equivalent(item_path, target_path, ec)) {
+				if (options.sync)
+					++options.unchanged;
+				return;
 			}
+			if (!options.overwrite && !options.sync)
+				msg = L"already exists";
+			else
+				filesystem::remove(item_path, ec);
+		}
+		if (!msg) {
+			filesystem::create_hard_link(target_path, item_path, ec);
+			if (ec)
+				msg = L"failed to create hard link";
+		}
+		if (msg)
+		{
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << prefix << L"* " << item_path << L"  *** " << msg << L" ***" << endl;
 		}
 	}
 
+	void EndItem()
+	{
+		Level level = stack.back();
+		stack.pop_back();
+		if (compact)
+			compact->End();
+		if (!level.selected)
+			;
+		else if (level.type == DirItem::Dir)
+			prefix.resize(prefix.size() - 2);
+		else
+			SetFileAttribs(level);
+		path.resize(level.path_len);
+	}
 
-	high_resolution_clock::time_point begin_time = high_resolution_clock::now();
+	void SetFileAttribs(Level& level)
+	{
+		if (options.sync && !options.test && !level.written) {
+			if (level.untouched) // neither data nor streams are changed
+				++options.unchanged;
+			else
+				level.written = true; // streams are rewritten, restore time
+		}
+		if (!level.written)
+			return;
+		// set file attributes: this must be made after all the streams of this file is written
+		FileSimple f;
+		FILE_BASIC_INFO fbi;
+		bool done = false;
+		if (f.OpenForAttribs(path.c_str(), true) &&
+			f.GetAttribs(&fbi))
+		{
+			fbi.LastWriteTime = fbi.ChangeTime = (LARGE_INTEGER&)level.ftLastWriteTime;
+			fbi.FileAttributes = level.dwFileAttributes;
+			done = f.SetAttribs(&fbi);
+		}
+		if (!done)
+		{
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << prefix << L"* " << path << L"  *** failed to set attributes *** " << endl;
+		}
+	}
 
-	TarFiles(writer.get(), std::move(gen), exclude, L"", L"");
-	writer->Write(EndArchive);
-	writer->Flush();
+	ITarReader* reader;
+	const Options& options;
+	vector<Level> stack;
+	DirItem di = {};     // header of the current item, name is not used
+	string name_utf8;
+	wstring name;
+	wstring path;        // current directory, or file if its streams are extracted
+	size_t dest_len;     // length of destination directory in path
+	wstring root;        // destination of the tar-file root
+	wstring rel_path;    // path in tar-file to match include masks
+	wstring stream_path;
+	wstring link;        // BeginLink: path in tar-file of the first name of the file
+	wstring item_path;
+	wstring target_path;
+	wstring prefix;      // indent for output
+	wstring rename;      // new name of the extracted item
+	optional<CompactHeaders> compact;
+	Checkpoint* checkpoint = nullptr;
+	const vector<wstring>* selection = nullptr;
+	vector<pair<wstring, wstring>>* missing_links = nullptr;
+};
 
-	high_resolution_clock::time_point end_time = high_resolution_clock::now();
-	duration<double> time_span = duration_cast<duration<double>>(end_time - begin_time);
+// counts the position in tar data for checkpoints
+class TarReaderCount : public ITarReader
+{
+public:
+	TarReaderCount(unique_ptr<ITarReader>&& src)
+		: src(move(src))
+	{
+	}
+	virtual void Read(void* buf, DWORD size) override
+	{
+		src->Read(buf, size);
+		position += size;
+	}
+	virtual void Skip(ULONGLONG size) override
+	{
+		src->Skip(size);
+		position += size;
+	}
+	ULONGLONG position = 0;
+protected:
+	unique_ptr<ITarReader> src;
+};
 
-	wcout << FileSizeStr(end_writer->written_total) << L" bytes wirtten in " << tarname.filename().c_str()
-		<< L" (" << time_span.count() << L" sec)" << endl;
-	return 0;
-}
 
+// threads - to decrypt framed tar-file
+// reader of the stages below deduplication: frames or ciphers, then decompression; the first byte is read
+unique_ptr<ITarReader> MakeStageReader(FileSimple& fs, const wchar_t* tarname, const vector<wstring>& pw, unsigned threads, char& first)
+{
+	if (!fs.Seek(0, FILE_BEGIN))
+		throw MyException{ L"Failed to read '<path>': <err>", tarname, GetLastError() };
+	char magic[sizeof(FrameMagic)];
+	unique_ptr<ITarReader> reader;
+	if (fs.Read(magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, FrameMagic, sizeof(magic)) == 0)
+		reader = unique_ptr<ITarReader>(new TarReaderFrames(fs, tarname, PasswordDigests(pw), max(1u, threads)));
+	else {
+		if (!fs.Seek(0, FILE_BEGIN))
+			throw MyException{ L"Failed to read '<path>': <err>", tarname, GetLastError() };
+		reader = CipherReader(unique_ptr<ITarReader>(new FileReader(fs, tarname)), PasswordDigests(pw));
+	}
+	reader->Read(first);
+	if (first == CompressMagic[0]) {
+		reader = unique_ptr<ITarReader>(new TarReaderDecompress(move(reader), max(1u, threads)));
+		reader->Read(first);
+	}
+	return reader;
+}
 
-struct Options
+unique_ptr<ITarReader> MakeReader(FileSimple& fs, const wchar_t* tarname, const vector<wstring>& pw, unsigned threads = 1)
 {
-	wstring stream_separator;
-	bool test = false;
-	bool overwrite = false;
-};
+	char first;
+	auto reader = MakeStageReader(fs, tarname, pw, threads, first);
+	if (first != DedupMagic[0])
+		return unique_ptr<ITarReader>(new TarReaderPrefix(move(reader), first));
+	// referenced chunks are read with its own handle, positions of readers do not interfere
+	auto file = make_shared<FileSimple>(tarname);
+	if (!file->IsOpen())
+		throw MyException{ L"Failed to open '<path>': <err>", tarname, GetLastError() };
+	return unique_ptr<ITarReader>(new TarReaderDedup(move(reader), [file, tarname, pw] {
+		char first;
+		return MakeStageReader(*file, tarname, pw, 1, first);
+	}));
+}
 
-void EnsureDirectoryExists(const filesystem::path& dir)
+// format flags from the beginning of tar data
+BYTE ReadFormat(FileSimple& fs, const wchar_t* tarname, const vector<wstring>& pw)
 {
-	if (!filesystem::exists(dir))
-		filesystem::create_directories(dir);
-	else if (!filesystem::is_directory(dir))
-		throw MyException{ L"Path is not a directory: '<path>'", dir.c_str(), 0 };
+	auto reader = MakeReader(fs, tarname, pw);
+	char type;
+	reader->Read(type);
+	BYTE flags = 0;
+	if (type == FormatHeader)
+		reader->Read(flags);
+	return flags;
 }
 
-bool WriteTo(const wchar_t* dest, ITarReader* reader, ULONGLONG total, const Options& options, const wstring& prefix)
+// index written by TarWriterIndex
+class TarIndex
 {
-	// wcout << dest << endl;
-	FileSimple fs_out;
-	if (!options.test)
+public:
+	// returns false if tar-file has no index
+	bool Load(FileSimple& fs, const wchar_t* tarname, const vector<wstring>& pw)
 	{
-		const wchar_t* msg = nullptr;
-		if (filesystem::exists(dest) && !options.overwrite)
-			msg = L"already exists";
-		else if (!fs_out.Open(dest, true, true))
-			msg = L"failed to create";
-		if (msg)
-		{
-			ConsoleColor cc(FOREGROUND_RED);
-			wcout << prefix << L"* " << dest << L"  *** " << msg << L" ***" << endl;
+		ULONGLONG data_size;
+		if (!FramedDataSize(fs, tarname, data_size)) {
+			// tar data (and output of the stages) is padded to 32 bytes, the ciphers add the same size then
+			ULONGLONG overhead = EncryptedSize(32, pw.size()) - 32;
+			ULONGLONG file_size = fs.GetLength64();
+			if (file_size < overhead)
+				return false;
+			data_size = file_size - overhead;
+		}
+		// the stages have their output size in their footers, outer stages first
+		char first;
+		MakeStageReader(fs, tarname, pw, 1, first)->DataSize(data_size);
+		if (first == DedupMagic[0])
+			MakeReader(fs, tarname, pw)->DataSize(data_size);
+		if (data_size < sizeof(IndexTrailer) || data_size % 32 != 0)
+			return false;
+
+		IndexTrailer trailer;
+		auto reader = MakeReader(fs, tarname, pw);
+		reader->Skip(data_size - sizeof(trailer));
+		reader->Read(trailer);
+		if (memcmp(trailer.magic, IndexMagic, sizeof(IndexMagic)) != 0) // no index or wrong password
+			return false;
+		ULONGLONG index_end = data_size - sizeof(trailer);
+		if (trailer.offset > index_end || trailer.count > (index_end - trailer.offset) / sizeof(IndexRecord) ||
+			trailer.names > index_end - trailer.offset - trailer.count * sizeof(IndexRecord))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+
+		offset = trailer.offset;
+		records.resize((size_t)trailer.count);
+		names.resize((size_t)trailer.names);
+		reader = MakeReader(fs, tarname, pw);
+		reader->Skip(trailer.offset);
+		ReadLarge(reader.get(), records.data(), records.size() * sizeof(IndexRecord));
+		ReadLarge(reader.get(), names.data(), names.size());
+
+		size_t name_len = 0;
+		ULONGLONG sums_count = 0;
+		for (size_t i = 0; i < records.size(); ++i) {
+			const IndexRecord& rec = records[i];
+			if ((rec.parent != IndexNoParent && rec.parent >= i) || rec.prefix > name_len ||
+				(ULONGLONG)rec.name + rec.suffix > names.size() ||
+				(rec.type != BeginDir && rec.type != BeginFile && rec.type != BeginStream && rec.type != BeginLink &&
+				rec.type != UnchangedFile && rec.type != DeletedItem && rec.type != DeltaFile))
+				throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+			name_len = rec.prefix + rec.suffix;
+			sums_count += SumsCount(rec);
+		}
+		if (sums_count > (index_end - trailer.offset - trailer.count * sizeof(IndexRecord) - trailer.names) / sizeof(BlockSum))
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		sums.resize((size_t)sums_count);
+		ReadLarge(reader.get(), sums.data(), sums.size() * sizeof(BlockSum));
+		return true;
+	}
+	// block signatures of the record in 'sums', they follow the ones of the previous records
+	static size_t SumsCount(const IndexRecord& rec)
+	{
+		return rec.flags & IndexSums ? size_t((rec.size + DeltaBlock - 1) / DeltaBlock) : 0;
+	}
+	// name of the record which follows the record of 'name', records must be taken in order
+	void NextName(const IndexRecord& rec, string& name) const
+	{
+		name.resize(rec.prefix);
+		name.append(names, rec.name, rec.suffix);
+	}
+	// name of any record, decoded from the nearest restart point
+	string Name(size_t i) const
+	{
+		size_t first = i / RestartInterval * RestartInterval;
+		string name;
+		for (size_t k = first; k <= i; ++k)
+			NextName(records[k], name);
+		return name;
+	}
+	// state of compact headers (FormatCompact) before the record
+	CompactHeaders HeaderState(size_t i) const { return HeaderState(i, records[i].parent); }
+	// ... before the record i (or the end of index) inside of parent
+	CompactHeaders HeaderState(size_t i, DWORD parent) const
+	{
+		size_t first = parent == IndexNoParent ? 0 : parent + 1;
+		size_t sibling = i;    // the previous item in the same directory or file
+		size_t file = i;       // the previous file in the same directory
+		for (size_t k = i; k > first && file == i; --k) {
+			if (records[k - 1].parent != parent)
+				continue;
+			if (sibling == i)
+				sibling = k - 1;
+			if (HasFileInfo(records[k - 1].type))
+				file = k - 1;
 		}
+		ULONGLONG time_base = 0;
+		if (file != i)
+			time_base = FileTimeValue(records[file].time);
+		else if (parent != IndexNoParent)
+			time_base = FileTimeValue(records[parent].time);
+		return CompactHeaders(sibling != i ? Name(sibling) : string(), time_base);
 	}
 
-	while (total != 0)
+	vector<IndexRecord> records;
+	string names;
+	vector<BlockSum> sums;
+	ULONGLONG offset = 0; // of the index in tar data, EndArchive precedes it
+
+protected:
+	static void ReadLarge(ITarReader* reader, void* buf, size_t size)
 	{
-		BYTE buf[64 * 1024];
-		SetLastError(0);
-		ULONGLONG to_read = sizeof(buf);
-		if (to_read > total)
-			to_read = total;
-		reader->Read(buf, (DWORD)to_read);
-		if (fs_out.IsOpen())
-		{
-			DWORD dwBytesWritten = fs_out.Write(buf, (DWORD)to_read);
-			if (dwBytesWritten != (DWORD)to_read)
-				throw MyException{ L"Failed to write '<path>': <err>", dest, GetLastError() };
+		uint8_t* ptr = (uint8_t*)buf;
+		while (size) {
+			DWORD part = size < 0x10000000 ? (DWORD)size : 0x10000000;
+			reader->Read(ptr, part);
+			ptr += part;
+			size -= part;
 		}
-		total -= to_read;
 	}
-	return fs_out.IsOpen();
+};
+
+bool BaseManifest::Load(const wchar_t* tarname, const vector<wstring>& pw)
+{
+	FileSimple fs(tarname);
+	if (!fs.IsOpen())
+		throw MyException{ L"Failed to open '<path>': <err>", tarname, GetLastError() };
+	TarIndex index;
+	if (!index.Load(fs, tarname, pw))
+		return false;
+	items.resize(index.records.size());
+	vector<wstring> dirs(index.records.size()); // lowercase paths of directories
+	string name_utf8;
+	wstring path;
+	size_t next_sum = 0;
+	for (size_t i = 0; i < index.records.size(); ++i) {
+		const IndexRecord& rec = index.records[i];
+		index.NextName(rec, name_utf8);
+		size_t first_sum = next_sum;
+		next_sum += TarIndex::SumsCount(rec);
+		if (rec.type == BeginStream || rec.type == DeletedItem)
+			continue;
+		Item& item = items[i];
+		item = { rec.type, rec.size, rec.time, rec.attributes, name_utf8 };
+		item.sums.assign(index.sums.begin() + first_sum, index.sums.begin() + next_sum);
+		(rec.parent == IndexNoParent ? root : items[rec.parent].children).push_back((DWORD)i);
+		ToWideChar(name_utf8, CP_UTF8, path);
+		for (auto& c : path)
+			c = towlower(c);
+		if (rec.parent != IndexNoParent)
+			path = dirs[rec.parent] + L'\\' + path;
+		if (rec.type == BeginDir)
+			dirs[i] = path;
+		paths[move(path)] = (DWORD)i;
+	}
+	return true;
 }
 
-bool ExtractItem(ITarReader* reader, const Options& options, const filesystem::path& dest, const wstring& prefix)
+// The last position before 'end' in tar data where blocks of all ciphers end: AES blocks are 16 bytes,
+// Shaker blocks are 32 bytes of the output of the first AES which starts with its iv
+ULONGLONG RestartPosition(ULONGLONG end, size_t layers)
 {
-	char type;
-	reader->Read(type);
+	return layers == 0 ? end : layers == 1 ? end / 16 * 16 : end < 16 ? 0 : (end - 16) / 32 * 32 + 16;
+}
 
-	DirItem di = {};
-	switch (type) {
-	case BeginDir:
-		di.type = DirItem::Dir;
-		break;
-	case BeginFile:
-		di.type = DirItem::File;
-		reader->Read(di.size);
-		reader->Read(di.dwFileAttributes);
-		reader->Read(di.ftLastWriteTime);
-		break;
-	case BeginStream:
-		di.type = DirItem::Stream;
-		reader->Read(di.size);
-		break;
-	case EndFile:
-	case EndDir:
-	case EndArchive:
-		return false;
-	default:
-		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+// the writers chain which continues plain or encrypted tar-file at 'restart' (see RestartPosition):
+// the file is cut there, the ciphers continue CBC from the ciphertext blocks before it;
+// at the very beginning the iv is written again
+unique_ptr<ITarWriter> ContinueWriter(const filesystem::path& tarname, const vector<array<uint8_t, 20>>& digests,
+	ULONGLONG restart, ITarWriter*& end_writer)
+{
+	size_t layers = digests.size();
+	bool write_iv = layers >= 2 && restart == 0;
+	ULONGLONG keep = layers == 0 ? restart : write_iv ? 0 : restart + 16; // bytes of the file which are not written again
+	vector<array<uint8_t, 16>> ivs(layers); // CBC state of AES layers at the restart position
+	{
+		FileSimple fs(tarname.c_str());
+		if (!fs.IsOpen())
+			throw MyException{ L"Failed to open '<path>': <err>", tarname.c_str(), GetLastError() };
+		// the output of AES layer before the restart position is decrypted by the outer layers only
+		for (size_t i = 0; i < layers; i += 2) {
+			if (i != 0 && keep == 0)
+				continue; // zero iv
+			if (!fs.Seek(0, FILE_BEGIN))
+				throw MyException{ L"Failed to read '<path>': <err>", tarname.c_str(), GetLastError() };
+			auto reader = CipherReader(unique_ptr<ITarReader>(new FileReader(fs, tarname.c_str())), digests, i + 1);
+			reader->Skip(restart);
+			reader->Read(ivs[i]);
+		}
 	}
+	TarWriterFiles* files = new TarWriterFiles(tarname, 0);
+	unique_ptr<ITarWriter> writer(files);
+	files->Append(keep);
+	end_writer = files;
+	writer = unique_ptr<ITarWriter>(new TarWriterBuffer(move(writer)));
+	if (layers)
+		writer = CipherWriter(move(writer), digests, ivs, write_iv);
+	return writer;
+}
 
-	WORD wlen;
-	reader->Read(wlen);
-	if (wlen > 500)
-		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
-	std::string name_utf8(size_t(wlen), '\0');
-	reader->Read(name_utf8.data(), wlen);
-	if (!IsUtf8(name_utf8.data(), wlen, true))
-		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+// Appending to a plain or encrypted tar-file (no frames, compression, deduplication): EndArchive and the index
+// are cut off, the ciphers continue CBC from the ciphertext blocks before them, so existing data is not encrypted
+// again except the tail after the last position where blocks of all ciphers end (less than 48 bytes).
+// Returns the first writer of the chain with the index of existing items; headers - the state at the end
+// of the root if the tar-file has compact headers.
+TarWriterIndex* AppendWriter(const filesystem::path& tarname, const vector<wstring>& pw, ITarWriter*& end_writer, optional<CompactHeaders>& headers)
+{
+	vector<array<uint8_t, 20>> digests = PasswordDigests(pw);
+	size_t layers = digests.size();
+	TarIndex index;
+	vector<BYTE> tail;                      // tar data from the restart position to EndArchive
+	ULONGLONG restart;
+	{
+		FileSimple fs(tarname.c_str());
+		if (!fs.IsOpen())
+			throw MyException{ L"Failed to open '<path>': <err>", tarname.c_str(), GetLastError() };
+		char magic[sizeof(FrameMagic)];
+		if (fs.Read(magic, sizeof(magic)) == sizeof(magic) && memcmp(magic, FrameMagic, sizeof(magic)) == 0)
+			throw MyException{ L"Only plain or encrypted tar-file can be appended: '<path>'", tarname.c_str(), 0 };
+		if (!index.Load(fs, tarname.c_str(), pw))
+			throw MyException{ L"Tar-file has no index: '<path>'", tarname.c_str(), 0 };
+		char first;
+		if (!fs.Seek(0, FILE_BEGIN))
+			throw MyException{ L"Failed to read '<path>': <err>", tarname.c_str(), GetLastError() };
+		CipherReader(unique_ptr<ITarReader>(new FileReader(fs, tarname.c_str())), digests)->Read(first);
+		if (first == CompressMagic[0] || first == DedupMagic[0])
+			throw MyException{ L"Only plain or encrypted tar-file can be appended: '<path>'", tarname.c_str(), 0 };
+		if (index.offset == 0)
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		if (ReadFormat(fs, tarname.c_str(), pw) & FormatCompact)
+			headers = index.HeaderState(index.records.size(), IndexNoParent);
+
+		ULONGLONG end = index.offset - 1; // EndArchive
+		restart = RestartPosition(end, layers);
+
+		if (!fs.Seek(0, FILE_BEGIN))
+			throw MyException{ L"Failed to read '<path>': <err>", tarname.c_str(), GetLastError() };
+		auto reader = CipherReader(unique_ptr<ITarReader>(new FileReader(fs, tarname.c_str())), digests);
+		reader->Skip(restart);
+		tail.resize(size_t(end - restart + 1));
+		reader->Read(tail.data(), (DWORD)tail.size());
+		if (tail.back() != EndArchive)
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		tail.pop_back();
+	}
 
-	wstring name = ToWideChar(name_utf8, CP_UTF8);
-	di.name = dest / name;
+	string last_name = index.records.empty() ? string() : index.Name(index.records.size() - 1);
+	unique_ptr<ITarWriter> writer = ContinueWriter(tarname, digests, restart, end_writer);
+	if (!tail.empty())
+		writer->Write(tail.data(), (DWORD)tail.size());
+	TarWriterIndex* index_writer = new TarWriterIndex(move(writer));
+	index_writer->Resume(move(index.records), move(index.names), move(index.sums), move(last_name), index.offset - 1);
+	return index_writer;
+}
+
+// the state of tar at the checkpoint: size of the tar-file on the disk, open items and recent data, compact headers
+void SaveTarState(ITarWriter* out, TarWriterFiles* files, const TarOptions& options)
+{
+	out->Write(files->Sync());
+	options.index->SaveState(out);
+	BYTE compact = options.headers != nullptr;
+	out->Write(compact);
+	if (options.headers)
+		options.headers->SaveState(out);
+}
 
-	PrintFileData(di, dest, prefix);
+// the block of the journal of checkpoints: records of the index and first names of files with several names
+// added after the previous one
+void SaveTarJournal(ITarWriter* out, const TarOptions& options)
+{
+	options.index->SaveJournal(out);
+	WriteVarint(out, options.links_added.size());
+	for (auto& id : options.links_added) {
+		out->Write(id);
+		WriteItems(out, options.links.at(id));
+	}
+	options.links_added.clear();
+}
 
-	if (di.type == DirItem::Stream && !options.stream_separator.empty()) {
-		// replace ':' with stream_separator
-		if (auto pos = name.find(L':'); pos != wstring::npos) {
-			name = name.substr(0, pos) + options.stream_separator + name.substr(pos + 1);
-			di.name = dest / name;
+// Continues the tar-file interrupted after its checkpoint (tar /u, plain or encrypted): the file is cut before
+// the end of its data which was on the disk at the checkpoint (at the restart position of the ciphers,
+// see RestartPosition), tar data from there up to the checkpoint is written again from the recent data of the index.
+// resume - the walk continues after the written items.
+TarWriterIndex* ResumeWriter(Checkpoint& checkpoint, const filesystem::path& tarname, const vector<wstring>& pw,
+	ITarWriter*& end_writer, optional<CompactHeaders>& headers, ResumePoint& resume, map<FileId, string>& links)
+{
+	ULONGLONG size;
+	unique_ptr<TarWriterIndex> index(new TarWriterIndex(nullptr)); // its writer is created after the state is read
+	{
+		FileSimple fs;
+		auto reader = checkpoint.Load(fs, [&](ITarReader* block) {
+			index->LoadJournal(block);
+			for (ULONGLONG count = ReadVarint(block); count; --count) {
+				FileId id;
+				block->Read(id);
+				ReadItems(block, links[id]);
+			}
+		});
+		reader->Read(size);
+		index->LoadState(reader.get());
+		BYTE compact;
+		reader->Read(compact);
+		if (compact) {
+			headers.emplace();
+			headers->LoadState(reader.get());
 		}
 	}
 
+	vector<array<uint8_t, 20>> digests = PasswordDigests(pw);
+	size_t layers = digests.size();
+	ULONGLONG margin = 64 * (layers + 1); // the file is ahead of tar data less than that
+	ULONGLONG end = index->position;
+	ULONGLONG restart = size < margin ? 0 : RestartPosition(min(end, size - margin), layers);
+	const vector<uint8_t>& recent = index->Recent();
+	if (end - restart > recent.size())
+		throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+	unique_ptr<ITarWriter> writer;
+	if (size < margin) { // nothing is sure to be on the disk, the tar-file is written again
+		writer = unique_ptr<ITarWriter>(new TarWriterFiles(tarname, 0));
+		end_writer = writer.get();
+		writer = unique_ptr<ITarWriter>(new TarWriterBuffer(move(writer)));
+		if (layers)
+			writer = CipherWriter(move(writer), digests, random_iv());
+	}
+	else
+		writer = ContinueWriter(tarname, digests, restart, end_writer);
+	if (end > restart)
+		writer->Write(recent.data() + recent.size() - (end - restart), DWORD(end - restart));
+	index->SetDestination(move(writer));
+
+	index->OpenItems(resume.dirs, resume.done);
+	resume.found.assign(resume.dirs.size(), false);
+	resume.entered.assign(resume.dirs.size(), false);
+	return index.release();
+}
+
+// prints items in the same way as TarExtractor in test mode
+void ListIndex(const TarIndex& index)
+{
+	vector<DWORD> depth(index.records.size());
+	string name_utf8;
+	wstring name;
+	wstring prefix;
+	for (size_t i = 0; i < index.records.size(); ++i) {
+		const IndexRecord& rec = index.records[i];
+		DWORD d = 0;
+		if (rec.parent != IndexNoParent) // streams are printed at the level of their file
+			d = depth[rec.parent] + (index.records[rec.parent].type == BeginDir ? 1 : 0);
+		depth[i] = d;
+		index.NextName(rec, name_utf8);
+		ToWideChar(name_utf8, CP_UTF8, name);
+		prefix.assign(d * 2, L' ');
+		if (rec.type == DeletedItem)
+			PrintDeleted(name, prefix);
+		else
+			PrintFileData(ItemType(rec.type), name, rec.size, prefix);
+	}
+}
+
+// finds directories and files by their paths in tar-file or by masks of their names or paths,
+// returns their records with their paths; items inside of returned ones are skipped
+vector<pair<size_t, wstring>> FindItems(const TarIndex& index, vector<wstring> paths, const vector<wstring>& masks)
+{
+	for (auto& p : paths) {
+		replace(p.begin(), p.end(), L'/', L'\\');
+		while (!p.empty() && p.back() == L'\\')
+			p.pop_back();
+		while (starts_with(p, L".\\"))
+			p.erase(0, 2);
+	}
+	vector<bool> found(paths.size());
+	vector<pair<size_t, wstring>> result;
 
-	switch (di.type)
+	struct Open
 	{
-	case DirItem::Dir: {
-		wstring next_prefix = prefix + L"  ";
-		if (!options.test)
-			EnsureDirectoryExists(di.name);
-		while (ExtractItem(reader, options, di.name, next_prefix)) {}   // write all streams
-		break;
+		DWORD record;
+		size_t path_len;
+	};
+	vector<Open> stack;     // directories and file containing the current record
+	DWORD selected = IndexNoParent; // the last found record, its contents are not returned
+	string name_utf8;
+	wstring name;
+	wstring path;           // of the current record
+	for (size_t i = 0; i < index.records.size(); ++i) {
+		const IndexRecord& rec = index.records[i];
+		index.NextName(rec, name_utf8);
+		// records of an item go one after another
+		if (selected != IndexNoParent && (rec.parent == IndexNoParent || rec.parent < selected))
+			selected = IndexNoParent;
+		if (rec.type == BeginStream || rec.type == DeletedItem)
+			continue;
+		while (!stack.empty() && stack.back().record != rec.parent)
+			stack.pop_back();
+		size_t parent_len = stack.empty() ? 0 : stack.back().path_len;
+		path.resize(parent_len);
+		if (!path.empty())
+			path += L'\\';
+		ToWideChar(name_utf8, CP_UTF8, name);
+		path += name;
+		stack.push_back({ (DWORD)i, path.size() });
+		bool match = false;
+		for (size_t k = 0; k < paths.size(); ++k) {
+			if (_wcsicmp(path.c_str(), paths[k].c_str()) == 0)
+				match = found[k] = true;
+		}
+		if (!match && selected == IndexNoParent && !masks.empty())
+			match = mask_match(name.c_str(), masks) || mask_match(path.c_str(), masks);
+		if (match && selected == IndexNoParent) { // else it is extracted with the found one
+			result.push_back({ i, path });
+			selected = (DWORD)i;
+		}
 	}
-	case DirItem::File: {
-		bool written = WriteTo(di.name.c_str(), reader, di.size, options, prefix);
-		while (ExtractItem(reader, options, dest, prefix)) {}   // write all streams
-		if (written)
-		{ // set file attributes: this must be made after all the streams of this file is written
-			FileSimple f;
-			FILE_BASIC_INFO fbi;
-			bool done = false;
-			if (f.OpenForAttribs(di.name.c_str(), true) &&
-				f.GetAttribs(&fbi))
-			{
-				fbi.LastWriteTime = fbi.ChangeTime = (LARGE_INTEGER&)di.ftLastWriteTime;
-				fbi.FileAttributes = di.dwFileAttributes;
-				done = f.SetAttribs(&fbi);
-			}
-			if (!done)
-			{
+	for (size_t k = 0; k < paths.size(); ++k) {
+		if (!found[k]) {
+			ConsoleColor cc(FOREGROUND_RED);
+			wcout << L"* " << paths[k] << L"  *** not found *** " << endl;
+		}
+	}
+	return result;
+}
+
+// extracts items of one tar-file (all or selected)
+void Extract(const filesystem::path& tarname, const filesystem::path& dest_dir, const vector<wstring>& select,
+	const vector<wstring>& pw, unsigned threads, Options& options)
+{
+	FileSimple fs(tarname.c_str());
+	if (!fs.IsOpen())
+		throw MyException{ L"Failed to open '<path>': <err>", tarname.c_str(), GetLastError() };
+
+	TarIndex index;
+	bool has_index = (options.test || !select.empty() || !options.include.empty()) && index.Load(fs, tarname.c_str(), pw);
+	if (!select.empty() && !has_index)
+		throw MyException{ L"Tar-file has no index: '<path>'", tarname.c_str(), 0 };
+	if (has_index && (!select.empty() || !options.include.empty())) {
+		// each item is read from its own position and extracted whole
+		vector<wstring> masks = move(options.include);
+		options.include.clear();
+		BYTE format = ReadFormat(fs, tarname.c_str(), pw);
+		auto found = FindItems(index, select, masks);
+		vector<wstring> selection;
+		for (auto& item : found)
+			selection.push_back(item.second);
+		vector<pair<wstring, wstring>> missing_links; // first name in tar-file, path of the link
+		for (auto& [record, item_path] : found) {
+			auto reader = MakeReader(fs, tarname.c_str(), pw, threads);
+			reader->Skip(index.records[record].offset);
+			auto pos = item_path.rfind(L'\\');
+			filesystem::path dest = pos == wstring::npos ? dest_dir : dest_dir / item_path.substr(0, pos);
+			if (!options.test)
+				EnsureDirectoryExists(dest);
+			TarExtractor extractor(reader.get(), options, dest);
+			extractor.SetRoot(dest_dir);
+			extractor.SetSelection(&selection, &missing_links);
+			if (format & FormatCompact)
+				extractor.SetCompact(index.HeaderState(record));
+			extractor.Run(true);
+		}
+		// the first name of a hard link is not selected: the link gets the file data of the first name
+		for (auto& [link, link_path] : missing_links) {
+			auto first = FindItems(index, { link }, {});
+			if (first.empty())
+				continue;
+			DWORD record = (DWORD)first[0].first;
+			filesystem::path dest(link_path);
+			if (index.records[record].type != BeginFile) {
 				ConsoleColor cc(FOREGROUND_RED);
-				wcout << prefix << L"* " << di.name.c_str() << L"  *** failed to set attributes *** " << endl;
+				wcout << L"* " << dest.c_str() << L"  *** skipped, its first name is not stored whole: " << link << L" ***" << endl;
+				continue;
 			}
+			auto reader = MakeReader(fs, tarname.c_str(), pw, threads);
+			reader->Skip(index.records[record].offset);
+			TarExtractor extractor(reader.get(), options, dest.parent_path());
+			extractor.SetRoot(dest_dir);
+			extractor.SetName(dest.filename().wstring());
+			if (format & FormatCompact)
+				extractor.SetCompact(index.HeaderState(record));
+			extractor.Run(true);
 		}
-		break;
+		options.include = move(masks); // for the next tar-file of the chain
 	}
-	case DirItem::Stream:
-		WriteTo(CorrectDirStreamName(di.name).c_str(), reader, di.size, options, prefix);
-		break;
+	else if (has_index) // test: only list
+		ListIndex(index);
+	else if (options.checkpoint) {
+		TarReaderCount reader(MakeReader(fs, tarname.c_str(), pw, threads));
+		TarExtractor extractor(&reader, options, dest_dir);
+		if (options.resume) { // the state after the number of tar-file
+			ULONGLONG position;
+			options.resume->Read(position);
+			reader.Skip(position);
+			extractor.LoadState(options.resume);
+			options.resume = nullptr;
+		}
+		options.checkpoint->state = [&](ITarWriter* out) {
+			out->Write(options.archive);
+			out->Write(reader.position);
+			extractor.SaveState(out);
+		};
+		extractor.SetCheckpoint(options.checkpoint);
+		extractor.Run();
 	}
-	return true;
+	else // without index include masks are checked while reading, data of other items is skipped
+		TarExtractor(MakeReader(fs, tarname.c_str(), pw, threads).get(), options, dest_dir).Run();
 }
 
-
 int Untar(int argc, Char** argv)
 {
 	if (argc < 3 || _tcscmp(argv[2], L"/?") == 0)
@@ -845,6 +4712,13 @@ int Untar(int argc, Char** argv)
 	Options options;
 	ULONGLONG part_size = 0;
 	wstring pass;
+	vector<wstring> select;
+	vector<wstring> chain;   // base and increments before tar-file
+	unsigned checkpoint_sec = 0; // period of checkpoints, 0 - no checkpoints
+	bool resume = false;     // continue after the checkpoint
+	optional<wstring> background; // limits of background mode
+	ULONGLONG memory_budget = 0; // for buffers of all stages, 0 - no budget
+	unsigned threads = thread::hardware_concurrency();
 	filesystem::path tarname;
 	filesystem::path dest_dir;
 
@@ -855,10 +4729,34 @@ int Untar(int argc, Char** argv)
 			options.test = true;
 		else if (param == L"/o")
 			options.overwrite = true;
+		else if (param == L"/s")
+			options.sync = true;
+		else if (param == L"/s:v")
+			options.sync = options.sync_verify = true;
 		else if (starts_with(param, L"/p:"))
 			pass = param.substr(3);
 		else if (starts_with(param, L"/f:"))
 			options.stream_separator = param.substr(3);
+		else if (starts_with(param, L"/i:"))
+			select = split(param.substr(3), L';');
+		else if (starts_with(param, L"/m:"))
+			options.include = split(param.substr(3), L';');
+		else if (starts_with(param, L"/c:"))
+			threads = (unsigned)ReadSize(param.substr(3));
+		else if (starts_with(param, L"/g:"))
+			chain = split(param.substr(3), L';');
+		else if (param == L"/k")
+			checkpoint_sec = 60;
+		else if (starts_with(param, L"/k:"))
+			checkpoint_sec = max(1u, (unsigned)ReadSize(param.substr(3)));
+		else if (param == L"/u")
+			resume = true;
+		else if (param == L"/n")
+			background.emplace();
+		else if (starts_with(param, L"/n:"))
+			background = param.substr(3);
+		else if (starts_with(param, L"/q:"))
+			memory_budget = ReadSize(param.substr(3));
 		else if (starts_with(param, L"/"))
 			throw invalid_argument("unrecognized option");
 		else if (tarname.empty())
@@ -874,8 +4772,33 @@ int Untar(int argc, Char** argv)
 		wcout << L", test";
 	if (options.overwrite)
 		wcout << L", overwrite";
+	if (options.sync)
+		wcout << (options.sync_verify ? L", sync with verification" : L", sync");
 	if (!pass.empty())
 		wcout << L", pass=" << pass;
+	if (!select.empty())
+		wcout << L", items=" << select;
+	if (!options.include.empty())
+		wcout << L", masks=" << options.include;
+	if (!chain.empty())
+		wcout << L", after " << chain;
+	if (resume && !checkpoint_sec)
+		checkpoint_sec = 60;
+	if (checkpoint_sec)
+		wcout << L", checkpoints every " << checkpoint_sec << L" sec";
+	if (resume)
+		wcout << L", resume";
+	optional<Throttle> throttle;
+	if (background) {
+		throttle.emplace(*background);
+		wstring limits = throttle->Description();
+		wcout << L", background" << (limits.empty() ? L"" : L" (" + limits + L")");
+	}
+	optional<MemoryBudget> budget;
+	if (memory_budget) {
+		budget.emplace(memory_budget);
+		wcout << L", memory budget " << FileSizeStr(memory_budget) << L" bytes";
+	}
 	if (dest_dir.empty())
 		dest_dir = L".";
 
@@ -885,38 +4808,60 @@ int Untar(int argc, Char** argv)
 		wcout << L", in current dir";
 	wcout << endl << endl;
 
-	FileSimple fs(tarname.c_str());
-	if (!fs.IsOpen())
-		throw MyException{ L"Failed to open '<path>': <err>", tarname.c_str(), GetLastError() };
+	// the positions are in whole tar data
+	if (checkpoint_sec && (options.test || !select.empty() || !options.include.empty()))
+		throw invalid_argument("/k and /u can not be used with /t, /i, /m");
 
 	if (!options.test)
 		EnsureDirectoryExists(dest_dir);
 
-	unique_ptr<ITarReader> reader(new FileReader(fs, tarname.c_str()));
+	vector<wstring> pw;
+	if (!pass.empty())
+		pw = split(pass, ',');
 
-	if (!pass.empty()) {
-		vector<wstring> pw = split(pass, ',');
-		for (int i = (int)pw.size() - 1; i >= 0; --i) {
-			string utf8 = ToChar(pw[i], CP_UTF8);
-			array<uint8_t, 20> digest = sha1_digest(utf8.data(), (unsigned int)utf8.size());
-			unique_ptr<ITarReader> src = move(reader);
-			if (i & 1)
-				reader = unique_ptr<ITarReader>(new TarReaderShaker(move(src), digest.data()));
-			else {
-				array<uint8_t, 16> key = digest_to_key(digest);
-				reader = unique_ptr<ITarReader>(new TarReaderAES(move(src), key.data(), i == 0));
-			}
-		}
+	unique_ptr<Checkpoint> checkpoint;
+	FileSimple checkpoint_file;
+	unique_ptr<ITarReader> state;
+	if (checkpoint_sec) {
+		checkpoint = make_unique<Checkpoint>(dest_dir / (tarname.filename() += L".ckpt"), pw, checkpoint_sec);
+		options.checkpoint = checkpoint.get();
+	}
+	if (resume) {
+		state = checkpoint->Load(checkpoint_file);
+		state->Read(options.archive);
+		if (options.archive > chain.size())
+			throw MyException{ L"Invalid tar file format or wrong password", L"", 0 };
+		options.resume = state.get();
+		if (!options.sync) // the items after the checkpoint can be extracted already
+			options.overwrite = true;
 	}
 
 	high_resolution_clock::time_point begin_time = high_resolution_clock::now();
 
-	while (ExtractItem(reader.get(), options, dest_dir, wstring())) {}
+	// base and increments are extracted in their order, the next ones replace files
+	for (DWORD i = 0; i < chain.size(); ++i) {
+		if (i < options.archive) // before the checkpoint
+			continue;
+		options.archive = i;
+		wcout << L"[" << chain[i] << L"]" << endl;
+		Extract(chain[i], dest_dir, select, pw, threads, options);
+		if (!options.sync)
+			options.overwrite = true;
+	}
+	options.archive = (DWORD)chain.size();
+	if (!chain.empty())
+		wcout << L"[" << tarname.c_str() << L"]" << endl;
+	Extract(tarname, dest_dir, select, pw, threads, options);
+	if (checkpoint)
+		checkpoint->Remove();
 
 	high_resolution_clock::time_point end_time = high_resolution_clock::now();
 	duration<double> time_span = duration_cast<duration<double>>(end_time - begin_time);
 
+	if (options.sync)
+		wcout << options.unchanged << L" unchanged files skipped ";
 	wcout << L"(" << time_span.count() << L" sec)" << endl;
+	PrintPeakMemory();
 
 	return 0;
 }
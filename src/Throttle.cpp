@@ -0,0 +1,173 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+#include "pch.h"
+#include "Throttle.h"
+#include "cryptar.h"
+#include "CommonFunc.h"
+
+#include <thread>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cwctype>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+	Throttle* active = nullptr;
+
+	// the process and the threads it starts later get background priority of CPU and I/O;
+	// it is not an error if the system does not allow that
+	void SetBackground()
+	{
+		SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+	}
+
+	bool ReadRate(wstring_view str, double& rate)
+	{
+		if (str.empty()) {
+			rate = 0;
+			return true;
+		}
+		wstring s(str);
+		wchar_t* e;
+		ULONGLONG ul = wcstoull(s.c_str(), &e, 10);
+		wstring_view suffix(e);
+		if (e == s.c_str())
+			return false;
+		if (suffix == L"K" || suffix == L"k")
+			ul *= 1024;
+		else if (suffix == L"M" || suffix == L"m")
+			ul *= 1024 * 1024;
+		else if (suffix == L"G" || suffix == L"g")
+			ul *= 1024 * 1024 * 1024;
+		else if (suffix != L"")
+			return false;
+		rate = double(ul);
+		return true;
+	}
+}
+
+Throttle::Throttle(wstring_view limits)
+{
+	if (!limits.empty() && limits[0] == L'@') {
+		control = limits.substr(1);
+		if (!Load())
+			throw MyException{ L"Invalid limits in '<path>'", control.wstring(), 0 };
+		next_check = steady_clock::now() + seconds(1);
+	}
+	else if (!Parse(limits))
+		throw invalid_argument("Invalid limits");
+	SetBackground();
+	active = this;
+}
+
+Throttle::~Throttle()
+{
+	active = nullptr;
+}
+
+void Throttle::Take(Kind kind, ULONGLONG amount)
+{
+	if (active && amount)
+		active->Wait(kind, amount);
+}
+
+// Token bucket: the operation waits until the bucket is not empty, then takes all it needs (can go below zero),
+// later operations wait until it is paid. Waits are at most a second long to apply changed limits soon.
+void Throttle::Wait(Kind kind, ULONGLONG amount)
+{
+	for (;;) {
+		duration<double> delay;
+		{
+			lock_guard<mutex> lock(mtx);
+			auto now = steady_clock::now();
+			if (!control.empty() && now >= next_check) {
+				next_check = now + seconds(1);
+				Load(); // invalid contents are ignored: the limits stay as they are
+			}
+			Bucket& b = buckets[kind];
+			if (!b.rate)
+				return;
+			b.tokens = min(b.rate, b.tokens + b.rate * duration<double>(now - b.last).count());
+			b.last = now;
+			if (b.tokens >= 0) {
+				b.tokens -= double(amount);
+				return;
+			}
+			delay = duration<double>(min(1.0, -b.tokens / b.rate));
+		}
+		this_thread::sleep_for(delay);
+	}
+}
+
+bool Throttle::Load()
+{
+	error_code ec;
+	auto time = filesystem::last_write_time(control, ec);
+	if (ec)
+		return false;
+	if (time == modified)
+		return true;
+	ifstream in(control);
+	string line;
+	getline(in, line);
+	if (!in && !in.eof())
+		return false;
+	modified = time;
+	return Parse(wstring(line.begin(), line.end()));
+}
+
+bool Throttle::Parse(wstring_view line)
+{
+	while (!line.empty() && iswspace(line.back()))
+		line.remove_suffix(1);
+	double rates[Kinds] = {};
+	for (int k = 0; k < Kinds; ++k) {
+		size_t comma = k + 1 < Kinds ? line.find(L',') : wstring_view::npos;
+		if (!ReadRate(line.substr(0, comma), rates[k]))
+			return false;
+		line = comma == wstring_view::npos ? wstring_view() : line.substr(comma + 1);
+	}
+	auto now = steady_clock::now();
+	for (int k = 0; k < Kinds; ++k) {
+		Bucket& b = buckets[k];
+		if (b.rate != rates[k]) {
+			b.rate = rates[k];
+			b.tokens = min(b.tokens, b.rate); // a debt is kept
+			b.last = now;
+		}
+	}
+	return true;
+}
+
+wstring Throttle::Description() const
+{
+	lock_guard<mutex> lock(mtx);
+	wstring s;
+	const wchar_t* names[Kinds] = { L"read ", L"write ", L"open " };
+	const wchar_t* units[Kinds] = { L" bytes/s", L" bytes/s", L" files/s" };
+	for (int k = 0; k < Kinds; ++k) {
+		if (buckets[k].rate)
+			s += (s.empty() ? L"" : L", ") + wstring(names[k]) + FileSizeStr(ULONGLONG(buckets[k].rate)) + units[k];
+	}
+	if (!control.empty())
+		s += (s.empty() ? L"" : L", ") + wstring(L"control file ") + control.wstring();
+	return s;
+}
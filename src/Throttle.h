@@ -0,0 +1,61 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <string_view>
+#include <filesystem>
+
+// Background mode (tar /n, untar /n): low CPU and I/O priority of the process and token buckets limiting
+// bytes read, bytes written and files opened per second by FileSimple.
+// The limits of a control file are read again when it is modified, so they can be changed while the work runs.
+class Throttle
+{
+public:
+	enum Kind { Read, Write, Open, Kinds };
+
+	// limits - "read,write,opens" per second (K, M, G suffixes; empty or 0 - no limit),
+	// or "@file" - the control file containing such a line; empty - only low priority
+	explicit Throttle(std::wstring_view limits);
+	~Throttle();
+	Throttle(const Throttle&) = delete;
+	Throttle& operator=(const Throttle&) = delete;
+
+	// waits until the limit allows 'amount' bytes or opens; nothing is done without active Throttle
+	static void Take(Kind kind, ULONGLONG amount);
+	std::wstring Description() const; // the limits, empty if there are none
+
+protected:
+	struct Bucket
+	{
+		double rate = 0;   // per second, 0 - no limit
+		double tokens = 0; // at most one second of rate; negative - taken ahead
+		std::chrono::steady_clock::time_point last;
+	};
+	void Wait(Kind kind, ULONGLONG amount);
+	bool Load(); // from the control file, returns false if it is invalid
+	bool Parse(std::wstring_view line);
+
+	std::filesystem::path control;
+	std::filesystem::file_time_type modified;
+	std::chrono::steady_clock::time_point next_check;
+
+	mutable std::mutex mtx; // protects all below
+	Bucket buckets[Kinds];
+};
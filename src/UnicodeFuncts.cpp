@@ -73,6 +73,14 @@ std::wstring ToWideChar(std::string_view str, UINT codepage)
 	return strWide;
 }
 
+void ToWideChar(std::string_view str, UINT codepage, std::wstring& out)
+{
+	// number of wide chars never exceeds number of bytes, so only one conversion pass is needed
+	out.resize(str.size());
+	int count = str.empty() ? 0 : ::MultiByteToWideChar(codepage, 0, str.data(), (int)str.size(), out.data(), (int)out.size());
+	out.resize(count > 0 ? count : 0);
+}
+
 
 std::string ToChar(std::wstring_view str, UINT codepage) // CP_ACP, CP_UTF8
 {
@@ -21,4 +21,5 @@ bool IsUtf8(const char * buf, int count, bool itsAll);
 bool IsUnicodeLE(char * buf, int count);
 bool IsUnicodeBE(char * buf, int count);
 std::wstring ToWideChar(std::string_view str, UINT codepage); // CP_ACP, CP_UTF8
+void ToWideChar(std::string_view str, UINT codepage, std::wstring& out); // reuses memory of out
 std::string ToChar(std::wstring_view str, UINT codepage); // CP_ACP, CP_UTF8
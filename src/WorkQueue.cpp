@@ -0,0 +1,87 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+#include "pch.h"
+#include "WorkQueue.h"
+
+using namespace std;
+
+WorkQueue::WorkQueue(unsigned nthreads)
+{
+	for (unsigned i = 0; i < nthreads; ++i)
+		threads.emplace_back(&WorkQueue::WorkerThread, this);
+}
+
+WorkQueue::~WorkQueue()
+{
+	{
+		lock_guard lock(mtx);
+		stop = true;
+	}
+	cv_work.notify_all();
+	for (auto& t : threads)
+		t.join();
+}
+
+WorkQueue::TaskPtr WorkQueue::Submit(function<void()> work)
+{
+	auto task = make_shared<Task>();
+	task->work = move(work);
+	{
+		lock_guard lock(mtx);
+		tasks.push_back(task);
+	}
+	cv_work.notify_one();
+	return task;
+}
+
+void WorkQueue::Wait(const TaskPtr& task)
+{
+	{
+		unique_lock lock(mtx);
+		cv_done.wait(lock, [&] { return task->done; });
+	}
+	if (task->error)
+		rethrow_exception(task->error);
+}
+
+void WorkQueue::WorkerThread()
+{
+	for (;;) {
+		TaskPtr task;
+		{
+			unique_lock lock(mtx);
+			cv_work.wait(lock, [this] { return stop || !tasks.empty(); });
+			if (stop)
+				return;
+			task = move(tasks.front());
+			tasks.pop_front();
+		}
+		exception_ptr error;
+		try {
+			task->work();
+		}
+		catch (...) {
+			error = current_exception();
+		}
+		{
+			lock_guard lock(mtx);
+			task->error = error;
+			task->done = true;
+		}
+		cv_done.notify_all();
+	}
+}
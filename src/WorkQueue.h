@@ -0,0 +1,60 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <condition_variable>
+
+// Runs tasks on several threads, the owner waits for them in the order it needs.
+// An exception of a task is rethrown by Wait.
+class WorkQueue
+{
+public:
+	struct Task
+	{
+		std::function<void()> work;
+		std::exception_ptr error;
+		bool done = false;
+	};
+	using TaskPtr = std::shared_ptr<Task>;
+
+	explicit WorkQueue(unsigned threads);
+	~WorkQueue();
+	WorkQueue(const WorkQueue&) = delete;
+	WorkQueue& operator=(const WorkQueue&) = delete;
+
+	TaskPtr Submit(std::function<void()> work);
+	// waits until the task is done
+	void Wait(const TaskPtr& task);
+
+protected:
+	void WorkerThread();
+
+	std::vector<std::thread> threads;
+
+	std::mutex mtx; // protects all below
+	std::condition_variable cv_work; // a task is submitted
+	std::condition_variable cv_done; // a task is done
+	std::deque<TaskPtr> tasks;
+	bool stop = false;
+};
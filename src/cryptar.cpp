@@ -60,15 +60,43 @@ namespace {
 			"Default file extension of tar-file is .ctar",
 			"options:",
 			"  /t             - test: valid console output but tar-file is not created",
+			"  /t:s           - only estimate upper bound of tar-file size from directory listings, files are not read",
 			"  /p:password    - password to encrypt tar-file",
 			"  /e:mask1;mask2 - masks to exclude files or directories",
+			"  /j:threads     - list directories ahead on several threads (slow or network drives)",
+			"  /r             - read files in the order of their placement on disk (HDD, fragmented volumes)",
+			"  /a:threads     - read files ahead on several threads (network drives), /r is ignored",
+			"  /h             - compact headers of items (many small files)",
+			"  /c:threads     - encrypt independent frames on several threads, needs /p",
+			"  /z             - compress (fast), /z:h - compress better but slower, /z:threads or /z:h,threads",
+			"  /d             - store repeated chunks of data once, /d:size - memory for chunk index (256M)",
+			"  /g:base        - incremental: only files changed since tar-file 'base' (same password)",
+			"  /x             - extend: append items to existing tar-file, not framed, compressed or deduplicated",
+			"  /b             - keep block signatures of files of 4M or more, /g stores only their changed blocks",
+			"  /w             - watch: then write changed items every 10 seconds in <tar-file>.0001 etc., /w:seconds",
+			"  /k             - save checkpoints every minute in <tar-file>.ckpt, /k:seconds; not with /c, /z, /d",
+			"  /u             - resume interrupted tar-file from its checkpoint (the same items and options)",
+			"  /n             - background: low CPU and disk priority",
+			"  /n:r,w,o       - also limit bytes read, bytes written and files opened per second (20M,10M,100)",
+			"  /n:@file       - the limits are in the file, it is read again when it changes",
+			"  /q:size        - memory budget for buffers of all stages (e.g. 256M), queues wait within it",
 			"\nCommand line arguments for '{prog} untar:'",
 			"untar [options] <tar-file> [<dir>]",
 			"where <dir> is directory to extract files from <tar-file> to, default is current",
 			"options:",
 			"  /t             - test: only list directories, files and streams",
 			"  /o             - overwrite existing files",
+			"  /s             - sync: skip existing files with the same size and time, overwrite others",
+			"  /s:v           - sync with verification: compare contents, write only differing parts",
 			"  /p:password    - password to decrypt tar-file",
+			"  /i:path1;path2 - extract only these directories and files (paths in tar-file)",
+			"  /m:mask1;mask2 - extract only items whose names or paths in tar-file match masks",
+			"  /c:threads     - decrypt frames and decompress on several threads, default: all cores",
+			"  /g:base1;inc1  - restore increment: extract the base and older increments first",
+			"  /k             - save checkpoints every minute in <dir>\\<tar-file>.ckpt, /k:seconds",
+			"  /u             - resume interrupted extraction from its checkpoint",
+			"  /n             - background: low CPU and disk priority, /n:r,w,o and /n:@file - limits as for tar",
+			"  /q:size        - memory budget for buffers of all stages (e.g. 256M), queues wait within it",
 		};
 		std::ranges::for_each(help, PrintLineSubst);
 
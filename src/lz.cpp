@@ -0,0 +1,276 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#include "pch.h"
+#include "lz.h"
+
+#include <string.h>
+#include <vector>
+
+namespace
+{
+	const size_t MinMatch = 4;
+	const size_t LastLiterals = 8; // matches do not reach the end of block, 4-byte reads stay inside
+
+	uint32_t read32(const uint8_t* p)
+	{
+		uint32_t v;
+		memcpy(&v, p, 4);
+		return v;
+	}
+
+	uint32_t hash(uint32_t v, int bits)
+	{
+		return (v * 2654435761u) >> (32 - bits);
+	}
+
+	class Output
+	{
+	public:
+		Output(uint8_t* dst, size_t capacity, int offset_bytes)
+			: dst(dst), end(dst + capacity), ptr(dst), offset_bytes(offset_bytes)
+		{
+		}
+		// literals, then match; len == 0 - the last sequence without match
+		bool Sequence(const uint8_t* lit, size_t lit_len, size_t offset, size_t len)
+		{
+			uint8_t* token = ptr;
+			if (!Room(1))
+				return false;
+			++ptr;
+			size_t ml = len ? len - MinMatch : 0;
+			*token = uint8_t((lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15));
+			if (lit_len >= 15 && !Length(lit_len - 15))
+				return false;
+			if (!Room(lit_len))
+				return false;
+			if (lit_len)
+				memcpy(ptr, lit, lit_len);
+			ptr += lit_len;
+			if (!len)
+				return true;
+			if (!Room(offset_bytes))
+				return false;
+			for (int i = 0; i < offset_bytes; ++i)
+				*ptr++ = uint8_t(offset >> (i * 8));
+			return ml < 15 || Length(ml - 15);
+		}
+		size_t Size() const { return ptr - dst; }
+	protected:
+		bool Room(size_t n) const { return size_t(end - ptr) >= n; }
+		bool Length(size_t n)
+		{
+			for (;;) {
+				if (!Room(1))
+					return false;
+				if (n < 255) {
+					*ptr++ = uint8_t(n);
+					return true;
+				}
+				*ptr++ = 255;
+				n -= 255;
+			}
+		}
+		uint8_t* dst;
+		uint8_t* end;
+		uint8_t* ptr;
+		int offset_bytes;
+	};
+
+	size_t compress_fast(const uint8_t* src, size_t size, Output& out)
+	{
+		const int bits = 16;
+		const size_t window = 0xFFFF;
+		std::vector<uint32_t> table(size_t(1) << bits); // position + 1
+		size_t anchor = 0;
+		size_t pos = 0;
+		size_t limit = size > LastLiterals + MinMatch ? size - LastLiterals - MinMatch : 0;
+		while (pos < limit) {
+			uint32_t h = hash(read32(src + pos), bits);
+			size_t cand = table[h];
+			table[h] = uint32_t(pos + 1);
+			if (!cand || pos - (cand - 1) > window || read32(src + cand - 1) != read32(src + pos)) {
+				pos += 1 + ((pos - anchor) >> 6); // faster on data without matches
+				continue;
+			}
+			size_t m = cand - 1;
+			size_t len = MinMatch;
+			while (pos + len < size - LastLiterals && src[m + len] == src[pos + len])
+				++len;
+			while (pos > anchor && m > 0 && src[pos - 1] == src[m - 1]) {
+				--pos;
+				--m;
+				++len;
+			}
+			if (!out.Sequence(src + anchor, pos - anchor, pos - m, len))
+				return 0;
+			pos += len;
+			anchor = pos;
+			if (pos < limit)
+				table[hash(read32(src + pos - 2), bits)] = uint32_t(pos - 1);
+		}
+		if (!out.Sequence(src + anchor, size - anchor, 0, 0))
+			return 0;
+		return out.Size();
+	}
+
+	class Chains
+	{
+	public:
+		Chains(const uint8_t* src, size_t size)
+			: src(src), size(size), head(size_t(1) << bits), prev(size)
+		{
+		}
+		// inserts positions up to pos (not included)
+		void Insert(size_t pos)
+		{
+			for (; next < pos; ++next) {
+				uint32_t h = hash(read32(src + next), bits);
+				prev[next] = head[h];
+				head[h] = uint32_t(next + 1);
+			}
+		}
+		// the longest match at pos, returns its length or 0
+		size_t Find(size_t pos, size_t max_len, size_t& offset)
+		{
+			Insert(pos);
+			size_t best = 0;
+			uint32_t first = read32(src + pos);
+			size_t cand = head[hash(first, bits)];
+			for (int depth = 0; cand && depth < MaxDepth; ++depth, cand = prev[cand - 1]) {
+				size_t m = cand - 1;
+				if (pos - m > Window)
+					break;
+				if (read32(src + m) != first || (best && src[m + best] != src[pos + best]))
+					continue;
+				size_t len = MinMatch;
+				while (len < max_len && src[m + len] == src[pos + len])
+					++len;
+				if (len > best) {
+					best = len;
+					offset = pos - m;
+					if (len == max_len)
+						break;
+				}
+			}
+			return best > MinMatch ? best : 0; // 3-byte offset: a match of MinMatch saves nothing
+		}
+	protected:
+		static const int bits = 17;
+		static const int MaxDepth = 64;
+		static const size_t Window = 0xFFFFFF;
+		const uint8_t* src;
+		size_t size;
+		size_t next = 0;             // the first position not inserted
+		std::vector<uint32_t> head;  // position + 1
+		std::vector<uint32_t> prev;
+	};
+
+	size_t compress_high(const uint8_t* src, size_t size, Output& out)
+	{
+		Chains chains(src, size);
+		size_t anchor = 0;
+		size_t pos = 0;
+		size_t limit = size > LastLiterals + MinMatch ? size - LastLiterals - MinMatch : 0;
+		while (pos < limit) {
+			size_t offset;
+			size_t len = chains.Find(pos, size - LastLiterals - pos, offset);
+			if (!len) {
+				++pos;
+				continue;
+			}
+			// lazy matching: a longer match at the next position is taken instead
+			while (pos + 1 < limit) {
+				size_t next_offset;
+				size_t next_len = chains.Find(pos + 1, size - LastLiterals - pos - 1, next_offset);
+				if (next_len <= len)
+					break;
+				++pos;
+				len = next_len;
+				offset = next_offset;
+			}
+			if (!out.Sequence(src + anchor, pos - anchor, offset, len))
+				return 0;
+			pos += len;
+			anchor = pos;
+		}
+		if (!out.Sequence(src + anchor, size - anchor, 0, 0))
+			return 0;
+		return out.Size();
+	}
+
+	bool read_length(const uint8_t*& src, const uint8_t* end, size_t& len)
+	{
+		uint8_t b;
+		do {
+			if (src == end)
+				return false;
+			b = *src++;
+			len += b;
+		} while (b == 255 && len < (size_t(1) << 30));
+		return b != 255;
+	}
+}
+
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, LzLevel level)
+{
+	Output out(dst, capacity, level == lz_fast ? 2 : 3);
+	return level == lz_fast ? compress_fast(src, size, out) : compress_high(src, size, out);
+}
+
+bool lz_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t size, LzLevel level)
+{
+	const uint8_t* end = src + src_size;
+	size_t offset_bytes = level == lz_fast ? 2 : 3;
+	size_t pos = 0;
+	for (;;) {
+		if (src == end)
+			return false;
+		uint8_t token = *src++;
+		size_t lit_len = token >> 4;
+		if (lit_len == 15 && !read_length(src, end, lit_len))
+			return false;
+		if (lit_len > size_t(end - src) || lit_len > size - pos)
+			return false;
+		if (lit_len)
+			memcpy(dst + pos, src, lit_len);
+		src += lit_len;
+		pos += lit_len;
+		if (src == end)
+			return pos == size;
+
+		if (size_t(end - src) < offset_bytes)
+			return false;
+		size_t offset = 0;
+		for (size_t i = 0; i < offset_bytes; ++i)
+			offset |= size_t(*src++) << (i * 8);
+		size_t len = token & 15;
+		if (len == 15 && !read_length(src, end, len))
+			return false;
+		len += MinMatch;
+		if (offset == 0 || offset > pos || len > size - pos)
+			return false;
+		uint8_t* d = dst + pos;
+		if (offset >= len)
+			memcpy(d, d - offset, len);
+		else {
+			for (size_t i = 0; i < len; ++i) // overlapped: repeats the last offset bytes
+				d[i] = d[i - offset];
+		}
+		pos += len;
+	}
+}
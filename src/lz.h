@@ -0,0 +1,33 @@
+/***********************************************************************
+
+  Copyright (c) 2019 Vsevolod Lukyanin
+  All rights reserved.
+
+  This file is a part of project ntfs_file_streams:
+  https://github.com/shtirlitz-dev/ntfs_file_streams
+
+  The tool that enables to list, create, copy, delete, show, write and
+  archive NTFS files streams.
+  About file streams:
+  https://docs.microsoft.com/en-us/windows/win32/fileio/file-streams
+
+***********************************************************************/
+
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// LZ77 compression of independent blocks.
+// A block is a sequence of: token (4 bits of literal count, 4 bits of match length - 4),
+// extra bytes of literal count if it is 15 (added while 255), literals,
+// offset of match (2 bytes for lz_fast, 3 bytes for lz_high), extra bytes of match length if it is 15.
+// The last sequence has only literals and ends the block.
+enum LzLevel { lz_fast, lz_high }; // greedy search in 64K window, or search in chains with lazy matching
+
+// returns compressed size, or 0 if it would exceed capacity
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst, size_t capacity, LzLevel level);
+// returns false if data is invalid or is not decompressed exactly to size bytes
+bool lz_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t size, LzLevel level);